@@ -0,0 +1,56 @@
+#ifndef BITPLANE_H
+#define BITPLANE_H
+#include <SDL2/SDL_rect.h>
+#include <grayscale.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Black and white image packed 64 pixels per word : pixel (x, y) is bit x%64
+ * of word x/64 of row y, 1 for ink. Every row starts on a new word, and the
+ * bits past w are always 0 */
+struct bitplane {
+    int w;
+    int h;
+    size_t words_per_row;
+    uint64_t *bits;
+};
+
+static inline const uint64_t *bitplane_row(const struct bitplane *bp, int y)
+{
+    return bp->bits + ((size_t)y * bp->words_per_row);
+}
+
+/* Whether (x, y) is ink, outside of the image is paper */
+static inline bool bitplane_get(const struct bitplane *bp, int x, int y)
+{
+    if (x < 0 || x >= bp->w || y < 0 || y >= bp->h)
+    {
+        return false;
+    }
+    return (bitplane_row(bp, y)[x >> 6] >> (x & 63)) & 1;
+}
+
+/* Blank (all paper) w x h bitplane, must be freed with free_bitplane */
+bool bitplane_alloc(int w, int h, struct bitplane *bp);
+void free_bitplane(struct bitplane *bp);
+
+/* Packs gray, everything that apply_threshold would turn black is ink */
+bool bitplane_threshold_alloc(const struct gray_image *gray, uint8_t threshold,
+                              struct bitplane *bp);
+
+/* Ink pixels of row y between columns x_min (included) and x_max (excluded) */
+int bitplane_count_row(const struct bitplane *bp, int y, int x_min, int x_max);
+
+/* Ink pixels of every row (rows[rect.h]) and column (cols[rect.w]) of rect.
+ * Either can be NULL, parts of rect outside of the image count as paper */
+void bitplane_projections(const struct bitplane *bp, SDL_Rect rect, int *rows,
+                          int *cols);
+
+/* Longest run of ink of every row (rows[rect.h]) and column (cols[rect.w]) of
+ * rect, in a single pass. Either can be NULL, same clipping as above.
+ * Returns false if out of memory, cols being left at 0 */
+bool bitplane_longest_runs(const struct bitplane *bp, SDL_Rect rect, int *rows,
+                           int *cols);
+
+#endif
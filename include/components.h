@@ -0,0 +1,37 @@
+#ifndef COMPONENTS_H
+#define COMPONENTS_H
+#include <bitplane.h>
+#include <locating.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bounding box, pixel count and centroid of a connected component */
+struct component {
+    struct bounding_box bb;
+    size_t area;
+    double cx;
+    double cy;
+};
+
+/* Label image : labels[(y * w) + x] is 0 for paper, n for a pixel of the
+ * component stats[n - 1] */
+struct components {
+    int w;
+    int h;
+    uint32_t *labels;
+    size_t count;
+    struct component *stats;
+};
+
+/* Labels the 4-connected components of the ink of bp, without recursion.
+ * Components are numbered in the order their first pixel is met row by row,
+ * same as a flood fill started from each unvisited pixel.
+ * With threads > 1, that many horizontal strips are labeled in parallel on
+ * the shared thread pool, then stitched.
+ * cc must be freed with free_components */
+bool label_components_alloc(const struct bitplane *bp, size_t threads,
+                            struct components *cc);
+void free_components(struct components *cc);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef DATASET_H
+#define DATASET_H
+#include <neural.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Training samples packed in a single file by dataset_pack : a
+ * struct dataset_header, then every sample as INPUT_SIZE bytes (0 paper, 1
+ * ink) from offset header.samples_offset, sorted by letter */
+#define DATASET_MAGIC "AUXDSET"
+enum { DATASET_VERSION = 1, DATASET_ALIGN = 64 };
+
+struct dataset_header {
+    char magic[8]; // DATASET_MAGIC, NUL included
+    uint32_t version;
+    uint32_t sample_size; // INPUT_SIZE
+    uint32_t classes;     // OUTPUT_SIZE
+    uint32_t count;
+    uint32_t samples_offset; // Multiple of DATASET_ALIGN
+    // Samples of the cth letter are those from class_first[c] to
+    // class_first[c + 1] excluded
+    uint32_t class_first[OUTPUT_SIZE + 1];
+};
+
+/* A packed file mapped in memory, read only */
+struct dataset {
+    size_t count;
+    size_t class_first[OUTPUT_SIZE + 1];
+    const uint8_t *samples;
+    void *map;
+    size_t map_size;
+};
+
+/* Packs the letter tree dir/<c>/<n>.bmp, n going from 0 to
+ * DATASET_PER_INPUT - 1, into path. Every image is binarized the same way as
+ * path_to_bytes. Missing images are counted and reported, not packed */
+bool dataset_pack(const char dir[static 1], const char path[static 1]);
+
+/* Maps the file written by dataset_pack. Fails if it isn't one or was packed
+ * for other sizes. set must be freed with free_dataset */
+bool dataset_load_alloc(const char path[static 1], struct dataset *set);
+void free_dataset(struct dataset *set);
+
+static inline const uint8_t *dataset_sample(const struct dataset *set,
+                                            size_t k)
+{
+    return set->samples + (k * INPUT_SIZE);
+}
+
+/* Number of samples of the cth letter */
+static inline size_t dataset_class_size(const struct dataset *set, size_t c)
+{
+    return set->class_first[c + 1] - set->class_first[c];
+}
+
+/* Letter of the kth sample, k < set->count */
+static inline size_t dataset_letter(const struct dataset *set, size_t k)
+{
+    size_t c = 0;
+    while (set->class_first[c + 1] <= k)
+    {
+        ++c;
+    }
+    return c;
+}
+
+#endif
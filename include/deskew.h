@@ -0,0 +1,23 @@
+#ifndef DESKEW_H
+#define DESKEW_H
+#include <bitplane.h>
+#include <stdbool.h>
+
+/* Skew of the lines of bp in degrees, positive when they go down to the
+ * right. The row profile of a downsampled copy is sharpest (highest
+ * variance) when sheared by the right angle, which is searched coarse to
+ * fine within MAX_SKEW degrees. Returns 0 if there is no ink */
+double estimate_skew(const struct bitplane *bp);
+
+/* Copy of src rotated around its center so that lines skewed by degrees end
+ * up horizontal, nearest neighbour. Same size as src : corners leaving the
+ * image are lost, those entering it are paper.
+ * dst must be freed with free_bitplane */
+bool bitplane_rotate_alloc(const struct bitplane *src, double degrees,
+                           struct bitplane *dst);
+
+/* estimate_skew then bitplane_rotate_alloc in place when the skew is worth
+ * it. Returns the angle that was corrected */
+double deskew_bitplane(struct bitplane *bp);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef GLYPH_H
+#define GLYPH_H
+#include <dataset.h>
+#include <neural.h>
+#include <rng.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Letters rendered from a TTF font, to train for a font without any image
+ * file. Every letter is rendered once with SDL_ttf, then each sample is
+ * drawn from it with its own scale, shift, rotation, stroke thickness and
+ * noise, binarized the same way as path_to_bytes (1 ink, 0 paper) */
+enum { GLYPH_SIZE = 64 };
+
+struct glyph_set {
+    // Ink coverage (0 to 255) of every capital letter, the larger side of
+    // its bounding box scaled to fit and centered
+    uint8_t masks[OUTPUT_SIZE][GLYPH_SIZE * GLYPH_SIZE];
+};
+
+/* Renders the capital letters of the font at path. Fails if SDL_ttf can't
+ * open it or it lacks one of them */
+bool glyph_set_load(const char path[static 1], struct glyph_set *glyphs);
+
+/* Draws a new sample of the cth letter */
+void glyph_render(const struct glyph_set *glyphs, size_t c, struct rng *rng,
+                  uint8_t sample[static INPUT_SIZE]);
+
+/* Samples drawn from a glyph_set, held in memory as a dataset so that
+ * neural_train takes them as any other */
+struct glyph_source {
+    const struct glyph_set *glyphs;
+    struct dataset set; // Its samples are those of buffer
+    uint8_t *buffer;
+};
+
+/* Room for per_letter samples of every letter, drawn by glyph_source_renew.
+ * source must be freed with free_glyph_source */
+bool glyph_source_alloc(const struct glyph_set *glyphs, size_t per_letter,
+                        struct glyph_source *source);
+void free_glyph_source(struct glyph_source *source);
+
+/* Draws every sample of the glyph_source anew, a letter per task of the
+ * default pool. Given to train_config.renew, every epoch trains on new
+ * samples */
+void glyph_source_renew(void *source, struct rng *rng);
+
+#endif
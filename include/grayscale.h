@@ -1,6 +1,16 @@
 #ifndef GRAYSCALE_H
 #define GRAYSCALE_H
 #include <SDL2/SDL_surface.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* 8 bit gray image, w*h bytes in row order. Once binarized, 0 is ink and 255
+ * is paper, same as apply_threshold */
+struct gray_image {
+    int w;
+    int h;
+    uint8_t *pixels;
+};
 
 /* Returns a grayscale copy of the surface src */
 SDL_Surface *grayscale(SDL_Surface *src);
@@ -13,6 +23,44 @@ uint8_t get_threshold(const SDL_Surface *gray);
 /* Return a black and white copy of the surface, according to the threshold */
 SDL_Surface *apply_threshold(SDL_Surface *src, uint8_t threshold);
 
+/* How gray levels are split between ink and paper */
+enum threshold_mode {
+    THRESHOLD_GLOBAL,  // A single Otsu threshold, see get_threshold
+    THRESHOLD_SAUVOLA, // Local mean and deviation, copes with uneven lighting
+    THRESHOLD_BRADLEY, // Local mean only, a bit cheaper than Sauvola
+};
+
+/* Same as apply_threshold, but with a threshold chosen for every pixel from
+ * the window x window square around it. src may be in any format.
+ * window <= 0 picks one from the size of the image */
+SDL_Surface *apply_local_threshold(SDL_Surface *src, enum threshold_mode mode,
+                                   int window);
+
+/* Same as grayscale and get_threshold in a single pass over src, without
+ * going through an RGB888 copy : fills gray and its histogram.
+ * gray must be freed with free_gray_image */
+bool grayscale_histogram_alloc(SDL_Surface *src, struct gray_image *gray,
+                               uint64_t histogram[static 256]);
+
+/* Otsu threshold of an histogram, see get_threshold */
+uint8_t otsu_threshold(const uint64_t histogram[static 256]);
+
+/* Same as apply_threshold, in place */
+void threshold_gray(struct gray_image *gray, uint8_t threshold);
+
+/* Same as apply_local_threshold, in place. The local means come from
+ * integral images of the sum and the sum of squares, so the cost per pixel
+ * doesn't depend on window. Returns false if out of memory */
+bool threshold_local(struct gray_image *gray, enum threshold_mode mode,
+                     int window);
+
+/* grayscale_histogram_alloc then threshold_gray or threshold_local :
+ * black and white version of src. bin must be freed with free_gray_image */
+bool binarize_alloc(SDL_Surface *src, enum threshold_mode mode,
+                    struct gray_image *bin);
+
+void free_gray_image(struct gray_image *img);
+
 /* Copies an (h*8)x(w*8) image into its hxw bitmap representation */
 int path_to_bitmap(const char path[restrict static 1],
                    uint8_t bitmap[restrict static 1], int h, int w);
@@ -20,4 +68,18 @@ int path_to_bitmap(const char path[restrict static 1],
 int path_to_bytes(const char path[restrict static 1],
                    uint8_t bitmap[restrict static 1], int h, int w);
 
+/* Resizes a src_w x src_h binarized buffer (1 = ink, rows pitch bytes apart)
+ * into the h x w input of the network by area averaging, same as
+ * path_to_bytes on a resized image but without going through a file.
+ * Returns 0 on failure */
+int resize_to_bytes(const uint8_t *restrict src, size_t pitch, int src_w,
+                    int src_h, uint_fast8_t bytes[restrict static 1], int h,
+                    int w);
+
+/* Copy of src turned clockwise by degrees around its center, like
+ * SDL_RenderCopyEx, with bilinear filtering. The copy is ARGB8888 and large
+ * enough to hold all of src, what src doesn't cover is white.
+ * Returns NULL on failure */
+SDL_Surface *rotate_surface_alloc(SDL_Surface *src, double degrees);
+
 #endif 
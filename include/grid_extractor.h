@@ -1,5 +1,30 @@
 #ifndef GRID_EXTRACTOR_H
 #define GRID_EXTRACTOR_H
+#include <SDL2/SDL_surface.h>
+#include <grayscale.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A binarized cell, w*h bytes in row order : 1 for ink, 0 for paper.
+ * Cells too small to be real cells are left empty (pixels == NULL) */
+struct cell_image {
+    int w;
+    int h;
+    uint8_t *pixels;
+};
+
+/* How the image is prepared before looking for the grid */
+struct extract_options {
+    enum threshold_mode threshold;
+    bool deskew; // Straightens the image first, see deskew_bitplane
+};
+
+/* Cells of the grid in row order, cell (i, j) is cells[(i * cols) + j] */
+struct grid_cells {
+    int rows;
+    int cols;
+    struct cell_image *cells;
+};
 
 /**
  * Main function to process the OCR image.
@@ -11,4 +36,13 @@
 void extract_grid_data(const char *input_path, const char *output_folder,
                        int *h_count, int *v_count);
 
+/* Same detection as extract_grid_data, but the cells of the grid are kept in
+ * memory instead of being written to disk.
+ * Returns false if no grid could be found or if out of memory, grid must be
+ * freed with free_grid_cells otherwise */
+bool extract_grid_cells_alloc(SDL_Surface *img,
+                              const struct extract_options *options,
+                              struct grid_cells *grid);
+void free_grid_cells(struct grid_cells *grid);
+
 #endif
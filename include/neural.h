@@ -2,6 +2,7 @@
 #define NEURAL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define LEARNING_RATE 0.01
@@ -17,31 +18,135 @@ enum {
     EPOCHS = 200
 };
 
-struct neural_network {
+/* Every array of struct neural_params starts on such a boundary */
+#define PARAMS_ALIGNED __attribute__((aligned(64)))
+
+/* Everything that is learnt, and all that a weights file holds. As every
+ * array is aligned, the layout only depends on the sizes above, and a mapped
+ * weights file can be used in place */
+struct neural_params {
+    double layer1_biases[LAYER1_SIZE] PARAMS_ALIGNED;
+    double layer2_biases[LAYER2_SIZE] PARAMS_ALIGNED;
+    double output_biases[OUTPUT_SIZE] PARAMS_ALIGNED;
+
+    // layer1_weights[j][i] : weight that the ith input is given by the ith
+    // layer1
+    double layer1_weights[LAYER1_SIZE][INPUT_SIZE] PARAMS_ALIGNED;
+    double layer2_weights[LAYER2_SIZE][LAYER1_SIZE] PARAMS_ALIGNED;
+    double output_weights[OUTPUT_SIZE][LAYER2_SIZE] PARAMS_ALIGNED;
+};
+
+/* Scratch of a forward pass, one per thread running them */
+struct neural_workspace {
     uint_fast8_t input[INPUT_SIZE];
     double layer1[LAYER1_SIZE];
     double layer2[LAYER2_SIZE];
     double output[OUTPUT_SIZE];
 
-    double layer1_biases[LAYER1_SIZE];
-    double layer2_biases[LAYER2_SIZE];
-    double output_biases[OUTPUT_SIZE];
+    // Indices of the non zero inputs
+    uint16_t active[INPUT_SIZE];
+    size_t n_active;
+};
 
-    // layer1_weights[j][i] : weight that the ith input is given by the ith
-    // layer1
-    double layer1_weights[LAYER1_SIZE][INPUT_SIZE];
-    double layer2_weights[LAYER2_SIZE][LAYER1_SIZE];
-    double output_weights[OUTPUT_SIZE][LAYER2_SIZE];
+/* Network being trained */
+struct neural_network {
+    struct neural_params params;
+    struct neural_workspace ws;
+};
+
+/* A weights file mapped read only, params pointing into the mapping */
+struct neural_weights {
+    const struct neural_params *params;
+    void *map;
+    size_t map_size;
+};
+
+/* Network ready for inference. It is loaded once and only read from then
+ * on, so any number of threads can share it, each with its own workspace */
+struct neural_model {
+    const struct neural_params *params;
+    // params->layer1_weights transposed : layer1_columns[i] holds the weights
+    // every layer1 neuron gives to the ith input
+    double (*layer1_columns)[LAYER1_SIZE];
+    struct neural_weights weights; // Mapping params points into, if any
+    struct neural_params *copy;    // What params points to otherwise
+};
+
+struct dataset;
+struct rng;
+
+/* What neural_train learns from, see dataset.h, and how */
+struct train_config {
+    const struct dataset *letters;
+    // Trained on instead of letters one epoch out of 15, may be NULL
+    const struct dataset *comparison;
+    // Above 1, the gradients of batch_size samples are computed in parallel
+    // by threads threads (0 for one per core) and averaged into a single
+    // step of LEARNING_RATE. Otherwise a step is taken after every sample, on
+    // the calling thread
+    size_t batch_size;
+    size_t threads;
+    // threads threads then take steps on their own samples at once, straight
+    // into the shared weights and without locks. batch_size is ignored
+    bool hogwild;
+    size_t epochs; // At most, 0 for EPOCHS
+    // An epoch visits every sample once, in a new order. Balanced, the less
+    // common letters are topped up with repeats to be seen as often as the
+    // most common one
+    bool balanced;
+    // Threads preparing batches of samples ahead of online or mini-batch
+    // training, 0 to prepare them on the training thread in between
+    size_t loaders;
+    // Of every random draw, 0 for one from the clock. The seed used is
+    // printed, a run seeded the same way starts from the same weights and
+    // sees the same samples
+    uint64_t seed;
+    // Called with renew_ctx before every epoch over letters, so that
+    // samples generated in memory are drawn anew (see glyph_source_renew).
+    // May be NULL
+    void (*renew)(void *ctx, struct rng *rng);
+    void *renew_ctx;
 };
 
 /* Initialises the network by training it from scratch */
-void neural_train(struct neural_network *);
-/* Initialises the network by training it from a file */
+void neural_train(struct neural_network *, const struct train_config *);
+/* Initialises the network by training it from a file. Files written before
+ * the current format (raw copies of the whole struct) are still read */
 void neural_load_weights(struct neural_network *, const char[static 1]);
-/* Writes trained weights to a file */
+/* Writes trained weights to a file : a header (format version, byte order,
+ * value type, layer sizes and checksum) then nn->params */
 void neural_save_weights(struct neural_network *, const char[static 1]);
 
+/* Maps a file written by neural_save_weights so that many processes can
+ * share a single copy of it. Fails if it is corrupted, was written for other
+ * sizes or by a different kind of machine, or uses the old format.
+ * weights must be freed with free_neural_weights */
+bool neural_weights_map_alloc(const char path[static 1],
+                              struct neural_weights *weights);
+void free_neural_weights(struct neural_weights *weights);
+
+/* Loads the weights file at path for inference : mapped in place when it
+ * can be, copied from the old format otherwise. model must be freed with
+ * free_neural_model */
+bool neural_model_load_alloc(const char path[static 1],
+                             struct neural_model *model);
+void free_neural_model(struct neural_model *model);
+
 /* Main function for the user */
-char neural_find_logic(struct neural_network *nn, const char path[static 1]);
+char neural_find_logic(const struct neural_model *model,
+                       struct neural_workspace *ws, const char path[static 1]);
+/* Same as neural_find_logic, for an input that is already in memory. Inputs
+ * are 0 or 1, only the layer1 columns of the 1s are summed. ws->output holds
+ * the scores of the letters afterwards */
+char neural_find_input(const struct neural_model *model,
+                       struct neural_workspace *ws,
+                       const uint_fast8_t input[static INPUT_SIZE]);
+/* Same as neural_find_input for n inputs, letters[k] being the letter of
+ * inputs[k]. They go through ws one after the other : layer1 only sums the
+ * columns of the ink pixels, which a dense product of the whole batch
+ * would be slower than */
+void neural_find_batch(const struct neural_model *model,
+                       struct neural_workspace *ws, size_t n,
+                       const uint_fast8_t inputs[][INPUT_SIZE], char letters[]);
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef RECOGNIZE_H
+#define RECOGNIZE_H
+#include <grid_extractor.h>
+#include <neural.h>
+
+/* Letters of the cells of grid, in row order : letters[(i * cols) + j] is
+ * the letter of cell (i, j), letters must have room for rows * cols. Cells
+ * are resized and classified on the shared pool, a few at a time so that
+ * threads done with easy cells take more. Empty cells are classified as
+ * blank inputs */
+void recognize_grid(const struct neural_model *model,
+                    const struct grid_cells *grid, char letters[]);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef RNG_H
+#define RNG_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* xoshiro256** generator. There is no global state and no lock : every
+ * thread drawing numbers owns one, and a run seeded the same way draws the
+ * same numbers */
+struct rng {
+    uint64_t s[4];
+};
+
+/* splitmix64, spreads any seed (0 included) over a whole state */
+static inline uint64_t rng_splitmix(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline void rng_seed(struct rng *rng, uint64_t seed)
+{
+    for (size_t i = 0; i < 4; ++i)
+    {
+        rng->s[i] = rng_splitmix(&seed);
+    }
+}
+
+static inline uint64_t rng_rotl(uint64_t x, unsigned int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rng_next(struct rng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+
+/* Uniform in [0, n), n > 0. The modulo bias is below n / 2^64 */
+static inline size_t rng_below(struct rng *rng, size_t n)
+{
+    return (size_t)(rng_next(rng) % n);
+}
+
+/* Uniform in [0, 1) */
+static inline double rng_double(struct rng *rng)
+{
+    return (double)(rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <threads.h>
+
+/* Workers started once and kept waiting for jobs. A job is split in tasks
+ * numbered from 0, the thread calling thread_pool_run takes tasks too */
+struct thread_pool {
+    size_t threads; // Workers + the calling thread
+    thrd_t *workers;
+    mtx_t run_lock; // One job at a time
+    mtx_t lock;
+    cnd_t wake;
+    cnd_t finished;
+    void (*job)(void *ctx, size_t task);
+    void *ctx;
+    size_t n_tasks;
+    size_t next_task;
+    size_t running;
+    bool stop;
+};
+
+/* Starts threads - 1 workers, threads == 0 meaning one thread per core.
+ * pool must be freed with free_thread_pool */
+bool thread_pool_alloc(size_t threads, struct thread_pool *pool);
+void free_thread_pool(struct thread_pool *pool);
+
+/* Runs job(ctx, task) for every task from 0 to n_tasks - 1 and waits for all
+ * of them. With a NULL pool, tasks simply run one after the other.
+ * A job must not run another job on the same pool */
+void thread_pool_run(struct thread_pool *pool,
+                     void (*job)(void *ctx, size_t task), void *ctx,
+                     size_t n_tasks);
+
+/* How many tasks n items should be split in : no more than the threads of
+ * the pool, and at least grain items per task */
+size_t thread_pool_tasks(const struct thread_pool *pool, size_t n,
+                         size_t grain);
+
+/* Items [begin, end) of task out of n_tasks, when n items are split evenly */
+static inline void task_range(size_t n, size_t n_tasks, size_t task,
+                              size_t *begin, size_t *end)
+{
+    *begin = (task * n) / n_tasks;
+    *end = ((task + 1) * n) / n_tasks;
+}
+
+/* Pool shared by the image stages, started on first use. Returns NULL if it
+ * could not be started, stages then run on the calling thread */
+struct thread_pool *thread_pool_default(void);
+
+/* Threads of the shared pool (0 for one per core), only has an effect before
+ * its first use */
+void thread_pool_set_default(size_t threads);
+
+#endif
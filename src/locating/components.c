@@ -0,0 +1,332 @@
+#include <components.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread_pool.h>
+
+/* Horizontal run of ink of row y, from x_min (included) to x_max (excluded) */
+struct run {
+    int y;
+    int x_min;
+    int x_max;
+};
+
+/* Rows y_min to y_max (excluded) of the image. Runs are numbered in raster
+ * order, row_first[y - y_min] being the first run of row y */
+struct strip {
+    const struct bitplane *bp;
+    int y_min;
+    int y_max;
+    struct run *runs;
+    size_t count;
+    size_t capacity;
+    size_t *row_first;
+    uint32_t *parent;
+    bool ok;
+};
+
+/* First x >= x_min where the pixel is ink (or paper), w if there is none */
+static int next_pixel(const uint64_t *row, int x, int w, bool ink)
+{
+    while (x < w)
+    {
+        uint64_t word = ink ? row[x >> 6] : ~row[x >> 6];
+        word >>= (x & 63);
+        if (word)
+        {
+            x += __builtin_ctzll(word);
+            return (x < w) ? x : w;
+        }
+        x = (x | 63) + 1;
+    }
+    return w;
+}
+
+static bool push_run(struct strip *strip, int y, int x_min, int x_max)
+{
+    if (strip->count == strip->capacity)
+    {
+        size_t capacity = strip->capacity ? 2 * strip->capacity : 256;
+        struct run *runs = realloc(strip->runs, capacity * sizeof(*runs));
+        if (!runs)
+        {
+            return false;
+        }
+        strip->runs = runs;
+        strip->capacity = capacity;
+    }
+    strip->runs[strip->count++] = (struct run){y, x_min, x_max};
+    return true;
+}
+
+static uint32_t find_root(uint32_t *parent, uint32_t i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]]; // Path halving
+        i = parent[i];
+    }
+    return i;
+}
+
+/* The smallest run always ends up as the root, so that the root of a
+ * component is its first run in raster order */
+static void unite(uint32_t *parent, uint32_t a, uint32_t b)
+{
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b)
+    {
+        parent[b] = a;
+    }
+    else if (b < a)
+    {
+        parent[a] = b;
+    }
+}
+
+/* Unites the runs [a, a_end) of a row with the overlapping runs [b, b_end) of
+ * the next one */
+static void unite_rows(const struct run *runs, uint32_t *parent, size_t a,
+                       size_t a_end, size_t b, size_t b_end)
+{
+    while (a < a_end && b < b_end)
+    {
+        if (runs[a].x_min < runs[b].x_max && runs[b].x_min < runs[a].x_max)
+        {
+            unite(parent, (uint32_t)a, (uint32_t)b);
+        }
+        // Move on the run that ends first, it can't overlap anything else
+        if (runs[a].x_max < runs[b].x_max)
+        {
+            a++;
+        }
+        else
+        {
+            b++;
+        }
+    }
+}
+
+/* First pass on a strip : runs and their local union-find */
+static void label_strip(void *arg, size_t task)
+{
+    struct strip *strip = (struct strip *)arg + task;
+    const struct bitplane *bp = strip->bp;
+
+    strip->row_first = malloc((size_t)(strip->y_max - strip->y_min + 1) *
+                              sizeof(*strip->row_first));
+    if (!strip->row_first)
+    {
+        return;
+    }
+
+    for (int y = strip->y_min; y < strip->y_max; y++)
+    {
+        strip->row_first[y - strip->y_min] = strip->count;
+        const uint64_t *row = bitplane_row(bp, y);
+        int x = next_pixel(row, 0, bp->w, true);
+        while (x < bp->w)
+        {
+            int end = next_pixel(row, x, bp->w, false);
+            if (!push_run(strip, y, x, end))
+            {
+                return;
+            }
+            x = next_pixel(row, end, bp->w, true);
+        }
+    }
+    strip->row_first[strip->y_max - strip->y_min] = strip->count;
+
+    strip->parent = malloc((strip->count + 1) * sizeof(*strip->parent));
+    if (!strip->parent)
+    {
+        return;
+    }
+    for (size_t i = 0; i < strip->count; i++)
+    {
+        strip->parent[i] = (uint32_t)i;
+    }
+    for (int y = strip->y_min + 1; y < strip->y_max; y++)
+    {
+        size_t *first = strip->row_first + (y - strip->y_min);
+        unite_rows(strip->runs, strip->parent, first[-1], first[0], first[0],
+                   first[1]);
+    }
+
+    strip->ok = true;
+}
+
+struct paint_job {
+    const struct strip *strip;
+    const uint32_t *run_labels;
+    struct components *cc;
+};
+
+/* Second pass on a strip : writes the final labels of its runs */
+static void paint_strip(void *arg, size_t task)
+{
+    struct paint_job *job = (struct paint_job *)arg + task;
+    const struct strip *strip = job->strip;
+    size_t w = (size_t)job->cc->w;
+    for (size_t i = 0; i < strip->count; i++)
+    {
+        const struct run *run = &strip->runs[i];
+        uint32_t *row = job->cc->labels + ((size_t)run->y * w);
+        for (int x = run->x_min; x < run->x_max; x++)
+        {
+            row[x] = job->run_labels[i];
+        }
+    }
+}
+
+static void add_run(struct component *c, const struct run *run)
+{
+    size_t len = (size_t)(run->x_max - run->x_min);
+    int last = run->x_max - 1;
+    if (c->area == 0)
+    {
+        c->bb = (struct bounding_box){run->x_min, run->y, last, run->y};
+    }
+    c->bb.x_min = (run->x_min < c->bb.x_min) ? run->x_min : c->bb.x_min;
+    c->bb.x_max = (last > c->bb.x_max) ? last : c->bb.x_max;
+    c->bb.y_max = run->y; // Runs come row by row
+    c->area += len;
+    // Sums for now, turned into means once every run is in
+    c->cx += (double)(run->x_min + run->x_max - 1) * (double)len / 2.0;
+    c->cy += (double)run->y * (double)len;
+}
+
+static void free_strips(struct strip *strips, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        free(strips[i].runs);
+        free(strips[i].row_first);
+        free(strips[i].parent);
+    }
+    free(strips);
+}
+
+bool label_components_alloc(const struct bitplane *bp, size_t threads,
+                            struct components *cc)
+{
+    *cc = (struct components){0};
+    size_t n = (threads == 0) ? 1 : threads;
+    n = (n > (size_t)bp->h) ? (size_t)bp->h : n;
+    if (n == 0)
+    {
+        return false;
+    }
+
+    struct strip *strips = calloc(n, sizeof(*strips));
+    if (!strips)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        strips[i].bp = bp;
+        strips[i].y_min = (int)((i * (size_t)bp->h) / n);
+        strips[i].y_max = (int)(((i + 1) * (size_t)bp->h) / n);
+    }
+    thread_pool_run(thread_pool_default(), label_strip, strips, n);
+
+    // Stitches the strips : one union-find over all the runs, in raster order
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!strips[i].ok)
+        {
+            free_strips(strips, n);
+            return false;
+        }
+        total += strips[i].count;
+    }
+    uint32_t *parent = malloc((total + 1) * sizeof(*parent));
+    struct run *runs = malloc((total + 1) * sizeof(*runs));
+    if (!parent || !runs || total >= UINT32_MAX)
+    {
+        free(parent);
+        free(runs);
+        free_strips(strips, n);
+        return false;
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t j = 0; j < strips[i].count; j++)
+        {
+            parent[offset + j] = (uint32_t)(strips[i].parent[j] + offset);
+        }
+        if (strips[i].count > 0)
+        {
+            memcpy(runs + offset, strips[i].runs,
+                   strips[i].count * sizeof(*runs));
+        }
+        if (i > 0)
+        {
+            const struct strip *above = &strips[i - 1];
+            size_t above_offset = offset - above->count;
+            size_t last_row = (size_t)(above->y_max - above->y_min - 1);
+            unite_rows(runs, parent,
+                       above_offset + above->row_first[last_row],
+                       offset, offset, offset + strips[i].row_first[1]);
+        }
+        offset += strips[i].count;
+    }
+
+    // Final labels, in place : a parent always comes before its children, so
+    // it already holds the label of the component when they are reached
+    for (size_t i = 0; i < total; i++)
+    {
+        parent[i] = (parent[i] == i) ? (uint32_t)++cc->count
+                                     : parent[parent[i]];
+    }
+
+    cc->w = bp->w;
+    cc->h = bp->h;
+    cc->labels = calloc((size_t)bp->w * (size_t)bp->h, sizeof(*cc->labels));
+    cc->stats = calloc(cc->count + 1, sizeof(*cc->stats));
+    struct paint_job *jobs = calloc(n, sizeof(*jobs));
+    if (!cc->labels || !cc->stats || !jobs)
+    {
+        free(jobs);
+        free(parent);
+        free(runs);
+        free_strips(strips, n);
+        free_components(cc);
+        return false;
+    }
+
+    for (size_t i = 0; i < total; i++)
+    {
+        add_run(&cc->stats[parent[i] - 1], &runs[i]);
+    }
+    for (size_t i = 0; i < cc->count; i++)
+    {
+        cc->stats[i].cx /= (double)cc->stats[i].area;
+        cc->stats[i].cy /= (double)cc->stats[i].area;
+    }
+
+    offset = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        jobs[i] = (struct paint_job){&strips[i], parent + offset, cc};
+        offset += strips[i].count;
+    }
+    thread_pool_run(thread_pool_default(), paint_strip, jobs, n);
+
+    free(jobs);
+    free(parent);
+    free(runs);
+    free_strips(strips, n);
+    return true;
+}
+
+void free_components(struct components *cc)
+{
+    free(cc->labels);
+    free(cc->stats);
+    *cc = (struct components){0};
+}
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <thread_pool.h>
+#include <unistd.h>
+
+/* Takes and runs tasks until there are none left, pool->lock held */
+static void run_tasks(struct thread_pool *pool)
+{
+    while (pool->next_task < pool->n_tasks)
+    {
+        size_t task = pool->next_task++;
+        pool->running++;
+        mtx_unlock(&pool->lock);
+        pool->job(pool->ctx, task);
+        mtx_lock(&pool->lock);
+        pool->running--;
+    }
+    if (pool->running == 0)
+    {
+        cnd_broadcast(&pool->finished);
+    }
+}
+
+static int worker(void *arg)
+{
+    struct thread_pool *pool = arg;
+    mtx_lock(&pool->lock);
+    while (!pool->stop)
+    {
+        if (pool->next_task < pool->n_tasks)
+        {
+            run_tasks(pool);
+        }
+        else
+        {
+            cnd_wait(&pool->wake, &pool->lock);
+        }
+    }
+    mtx_unlock(&pool->lock);
+    return 0;
+}
+
+bool thread_pool_alloc(size_t threads, struct thread_pool *pool)
+{
+    *pool = (struct thread_pool){0};
+    if (threads == 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cores > 0) ? (size_t)cores : 1;
+    }
+
+    pool->workers = calloc(threads, sizeof(*pool->workers));
+    if (!pool->workers)
+    {
+        return false;
+    }
+    if (mtx_init(&pool->run_lock, mtx_plain) != thrd_success ||
+        mtx_init(&pool->lock, mtx_plain) != thrd_success ||
+        cnd_init(&pool->wake) != thrd_success ||
+        cnd_init(&pool->finished) != thrd_success)
+    {
+        free(pool->workers);
+        return false;
+    }
+
+    // The calling thread counts as one, a pool with fewer workers than
+    // asked for still works
+    pool->threads = 1;
+    for (size_t i = 1; i < threads; i++)
+    {
+        if (thrd_create(&pool->workers[pool->threads - 1], worker, pool) !=
+            thrd_success)
+        {
+            break;
+        }
+        pool->threads++;
+    }
+    return true;
+}
+
+void free_thread_pool(struct thread_pool *pool)
+{
+    if (!pool->workers)
+    {
+        return;
+    }
+    mtx_lock(&pool->lock);
+    pool->stop = true;
+    cnd_broadcast(&pool->wake);
+    mtx_unlock(&pool->lock);
+    for (size_t i = 0; i + 1 < pool->threads; i++)
+    {
+        thrd_join(pool->workers[i], NULL);
+    }
+
+    cnd_destroy(&pool->wake);
+    cnd_destroy(&pool->finished);
+    mtx_destroy(&pool->lock);
+    mtx_destroy(&pool->run_lock);
+    free(pool->workers);
+    *pool = (struct thread_pool){0};
+}
+
+void thread_pool_run(struct thread_pool *pool,
+                     void (*job)(void *ctx, size_t task), void *ctx,
+                     size_t n_tasks)
+{
+    if (!pool || pool->threads <= 1 || n_tasks <= 1)
+    {
+        for (size_t task = 0; task < n_tasks; task++)
+        {
+            job(ctx, task);
+        }
+        return;
+    }
+
+    mtx_lock(&pool->run_lock);
+    mtx_lock(&pool->lock);
+    pool->job = job;
+    pool->ctx = ctx;
+    pool->n_tasks = n_tasks;
+    pool->next_task = 0;
+    cnd_broadcast(&pool->wake);
+
+    run_tasks(pool);
+    while (pool->running > 0)
+    {
+        cnd_wait(&pool->finished, &pool->lock);
+    }
+    pool->n_tasks = 0;
+    pool->next_task = 0;
+    mtx_unlock(&pool->lock);
+    mtx_unlock(&pool->run_lock);
+}
+
+size_t thread_pool_tasks(const struct thread_pool *pool, size_t n,
+                         size_t grain)
+{
+    size_t threads = pool ? pool->threads : 1;
+    size_t tasks = (grain > 0) ? n / grain : n;
+    tasks = (tasks > threads) ? threads : tasks;
+    return (tasks == 0) ? 1 : tasks;
+}
+
+static struct thread_pool shared_pool;
+static bool shared_started = false;
+static size_t shared_threads = 0;
+static once_flag shared_once = ONCE_FLAG_INIT;
+
+static void start_shared_pool(void)
+{
+    shared_started = thread_pool_alloc(shared_threads, &shared_pool);
+}
+
+struct thread_pool *thread_pool_default(void)
+{
+    call_once(&shared_once, start_shared_pool);
+    return shared_started ? &shared_pool : NULL;
+}
+
+void thread_pool_set_default(size_t threads)
+{
+    shared_threads = threads;
+}
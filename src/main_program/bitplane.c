@@ -0,0 +1,431 @@
+#include <bitplane.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread_pool.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+bool bitplane_alloc(int w, int h, struct bitplane *bp)
+{
+    *bp = (struct bitplane){0};
+    if (w <= 0 || h <= 0)
+    {
+        return false;
+    }
+
+    size_t words_per_row = ((size_t)w + 63) / 64;
+    bp->bits = calloc(words_per_row * (size_t)h, sizeof(*bp->bits));
+    if (!bp->bits)
+    {
+        return false;
+    }
+    bp->w = w;
+    bp->h = h;
+    bp->words_per_row = words_per_row;
+    return true;
+}
+
+void free_bitplane(struct bitplane *bp)
+{
+    free(bp->bits);
+    *bp = (struct bitplane){0};
+}
+
+/* Ink mask of the 64 pixels (at most) of a gray row starting at x */
+static uint64_t threshold_word(const uint8_t *restrict row, int x, int w,
+                               uint8_t threshold)
+{
+    uint64_t word = 0;
+    int end = (x + 64 < w) ? x + 64 : w;
+    int i = x;
+
+    // Same biased signed compare as threshold_gray, movemask then gives one
+    // bit per pixel, set for paper
+#if defined(__AVX2__)
+    const __m256i bias = _mm256_set1_epi8((char)0x80);
+    const __m256i tv = _mm256_set1_epi8((char)(threshold ^ 0x80));
+    for (; i <= end - 32; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const void *)(row + i));
+        uint32_t paper = (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpgt_epi8(_mm256_xor_si256(v, bias), tv));
+        word |= (uint64_t)(~paper) << (i - x);
+    }
+#elif defined(__SSE2__)
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    const __m128i tv = _mm_set1_epi8((char)(threshold ^ 0x80));
+    for (; i <= end - 16; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const void *)(row + i));
+        uint32_t paper = (uint32_t)_mm_movemask_epi8(
+            _mm_cmpgt_epi8(_mm_xor_si128(v, bias), tv));
+        word |= (uint64_t)(~paper & 0xFFFF) << (i - x);
+    }
+#endif
+    for (; i < end; i++)
+    {
+        word |= (uint64_t)(row[i] <= threshold) << (i - x);
+    }
+    return word;
+}
+
+/* Rows given to each task, and words of a row for column work */
+enum { ROWS_PER_TASK = 32, WORDS_PER_TASK = 4 };
+
+struct threshold_job {
+    const struct gray_image *gray;
+    uint8_t threshold;
+    struct bitplane *bp;
+    size_t n_tasks;
+};
+
+static void threshold_strip(void *arg, size_t task)
+{
+    struct threshold_job *job = arg;
+    const struct gray_image *gray = job->gray;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range((size_t)gray->h, job->n_tasks, task, &begin, &end);
+
+    for (size_t y = begin; y < end; y++)
+    {
+        const uint8_t *row = gray->pixels + (y * (size_t)gray->w);
+        uint64_t *out = job->bp->bits + (y * job->bp->words_per_row);
+        for (int x = 0; x < gray->w; x += 64)
+        {
+            out[x / 64] = threshold_word(row, x, gray->w, job->threshold);
+        }
+    }
+}
+
+bool bitplane_threshold_alloc(const struct gray_image *gray, uint8_t threshold,
+                              struct bitplane *bp)
+{
+    if (!bitplane_alloc(gray->w, gray->h, bp))
+    {
+        return false;
+    }
+
+    struct thread_pool *pool = thread_pool_default();
+    struct threshold_job job = {
+        gray, threshold, bp,
+        thread_pool_tasks(pool, (size_t)gray->h, ROWS_PER_TASK)};
+    thread_pool_run(pool, threshold_strip, &job, job.n_tasks);
+    return true;
+}
+
+/* Bits x_min (included) to x_max (excluded) of a word */
+static inline uint64_t bit_range(int x_min, int x_max)
+{
+    uint64_t high = (x_max >= 64) ? ~0ULL : ((1ULL << x_max) - 1);
+    return high & ~((1ULL << x_min) - 1);
+}
+
+int bitplane_count_row(const struct bitplane *bp, int y, int x_min, int x_max)
+{
+    if (y < 0 || y >= bp->h)
+    {
+        return 0;
+    }
+    x_min = (x_min < 0) ? 0 : x_min;
+    x_max = (x_max > bp->w) ? bp->w : x_max;
+    if (x_min >= x_max)
+    {
+        return 0;
+    }
+
+    const uint64_t *row = bitplane_row(bp, y);
+    int first = x_min / 64;
+    int last = (x_max - 1) / 64;
+    if (first == last)
+    {
+        return __builtin_popcountll(row[first] &
+                                    bit_range(x_min % 64, x_max - (64 * last)));
+    }
+
+    int count = __builtin_popcountll(row[first] & bit_range(x_min % 64, 64));
+    for (int i = first + 1; i < last; i++)
+    {
+        count += __builtin_popcountll(row[i]);
+    }
+    count +=
+        __builtin_popcountll(row[last] & bit_range(0, x_max - (64 * last)));
+    return count;
+}
+
+/* Transposes a 64x64 bit block : bit c of a[r] goes to bit r of a[c] */
+static void transpose64(uint64_t a[static 64])
+{
+    static const uint64_t masks[] = {
+        0x00000000FFFFFFFFULL, 0x0000FFFF0000FFFFULL, 0x00FF00FF00FF00FFULL,
+        0x0F0F0F0F0F0F0F0FULL, 0x3333333333333333ULL, 0x5555555555555555ULL,
+    };
+    int j = 32;
+    for (size_t m = 0; m < sizeof(masks) / sizeof(*masks); m++, j >>= 1)
+    {
+        for (int k = 0; k < 64; k = ((k | j) + 1) & ~j)
+        {
+            uint64_t t = ((a[k] >> j) ^ a[k | j]) & masks[m];
+            a[k | j] ^= t;
+            a[k] ^= t << j;
+        }
+    }
+}
+
+/* rect clipped to the image, and the words of a row it covers */
+struct clipped_rect {
+    int x_min;
+    int x_max;
+    int y_min;
+    int y_max;
+    int first_word;
+    size_t n_words;
+};
+
+static bool clip_rect(const struct bitplane *bp, SDL_Rect rect,
+                      struct clipped_rect *clip)
+{
+    clip->x_min = (rect.x < 0) ? 0 : rect.x;
+    clip->x_max = (rect.x + rect.w > bp->w) ? bp->w : rect.x + rect.w;
+    clip->y_min = (rect.y < 0) ? 0 : rect.y;
+    clip->y_max = (rect.y + rect.h > bp->h) ? bp->h : rect.y + rect.h;
+    if (clip->x_min >= clip->x_max || clip->y_min >= clip->y_max)
+    {
+        return false;
+    }
+    clip->first_word = clip->x_min / 64;
+    clip->n_words = (size_t)((clip->x_max - 1) / 64 - clip->first_word + 1);
+    return true;
+}
+
+/* Rows or columns of rect given to a task. Tasks either take rows, or words
+ * of the columns (so they never share a counter), the rest of the array */
+struct rect_job {
+    const struct bitplane *bp;
+    SDL_Rect rect;
+    struct clipped_rect clip;
+    int *rows;
+    int *cols;
+    size_t row_tasks;
+    size_t col_tasks;
+    uint64_t *previous; // For bitplane_longest_runs
+    int *run_start;
+};
+
+static void project_rows(void *arg, size_t task)
+{
+    struct rect_job *job = arg;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range((size_t)job->rect.h, job->row_tasks, task, &begin, &end);
+    for (size_t y = begin; y < end; y++)
+    {
+        job->rows[y] = bitplane_count_row(job->bp, job->rect.y + (int)y,
+                                          job->rect.x,
+                                          job->rect.x + job->rect.w);
+    }
+}
+
+// Columns are counted 64x64 pixels at a time : once a block is transposed,
+// each of its columns is a word to popcount
+static void project_cols(void *arg, size_t task)
+{
+    struct rect_job *job = arg;
+    const struct clipped_rect *clip = &job->clip;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range(clip->n_words, job->col_tasks, task, &begin, &end);
+
+    uint64_t block[64];
+    for (int y0 = clip->y_min; y0 < clip->y_max; y0 += 64)
+    {
+        int block_h = (clip->y_max - y0 < 64) ? clip->y_max - y0 : 64;
+        for (size_t i = begin; i < end; i++)
+        {
+            int word = clip->first_word + (int)i;
+            int bit_min = (clip->x_min > 64 * word) ? clip->x_min - (64 * word)
+                                                    : 0;
+            int bit_max = (clip->x_max < 64 * (word + 1))
+                              ? clip->x_max - (64 * word)
+                              : 64;
+            uint64_t mask = bit_range(bit_min, bit_max);
+
+            uint64_t any = 0;
+            for (int k = 0; k < block_h; k++)
+            {
+                block[k] = bitplane_row(job->bp, y0 + k)[word] & mask;
+                any |= block[k];
+            }
+            if (!any)
+            {
+                continue; // Blank block, mostly paper
+            }
+            memset(block + block_h, 0,
+                   (size_t)(64 - block_h) * sizeof(*block));
+
+            transpose64(block);
+            for (int b = bit_min; b < bit_max; b++)
+            {
+                job->cols[(64 * word) + b - job->rect.x] +=
+                    __builtin_popcountll(block[b]);
+            }
+        }
+    }
+}
+
+void bitplane_projections(const struct bitplane *bp, SDL_Rect rect, int *rows,
+                          int *cols)
+{
+    struct thread_pool *pool = thread_pool_default();
+    struct rect_job job = {bp, rect, {0}, rows, cols, 0, 0, NULL, NULL};
+    if (rows)
+    {
+        job.row_tasks = thread_pool_tasks(pool, (size_t)rect.h, ROWS_PER_TASK);
+        thread_pool_run(pool, project_rows, &job, job.row_tasks);
+    }
+    if (!cols)
+    {
+        return;
+    }
+
+    memset(cols, 0, (size_t)(rect.w > 0 ? rect.w : 0) * sizeof(*cols));
+    if (!clip_rect(bp, rect, &job.clip))
+    {
+        return;
+    }
+    job.col_tasks = thread_pool_tasks(pool, job.clip.n_words, WORDS_PER_TASK);
+    thread_pool_run(pool, project_cols, &job, job.col_tasks);
+}
+
+/* Longest run of ink of a row between x_min (included) and x_max (excluded),
+ * skipping whole runs of ink or paper at a time */
+static int longest_run_row(const uint64_t *row, int x_min, int x_max)
+{
+    int best = 0;
+    int current = 0;
+    int x = x_min;
+    while (x < x_max)
+    {
+        int avail = 64 - (x & 63);
+        avail = (avail > x_max - x) ? x_max - x : avail;
+        uint64_t word = row[x >> 6] >> (x & 63);
+        word &= (avail < 64) ? (1ULL << avail) - 1 : ~0ULL;
+
+        if (current > 0 || (word & 1))
+        {
+            int ones = (~word == 0) ? 64 : __builtin_ctzll(~word);
+            current += ones;
+            x += ones;
+            if (ones < avail)
+            {
+                best = (current > best) ? current : best;
+                current = 0;
+            }
+            continue;
+        }
+        x += (word == 0) ? avail : __builtin_ctzll(word);
+    }
+    return (current > best) ? current : best;
+}
+
+static void longest_run_rows(void *arg, size_t task)
+{
+    struct rect_job *job = arg;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range((size_t)(job->clip.y_max - job->clip.y_min), job->row_tasks,
+               task, &begin, &end);
+    for (size_t i = begin; i < end; i++)
+    {
+        int y = job->clip.y_min + (int)i;
+        job->rows[y - job->rect.y] = longest_run_row(
+            bitplane_row(job->bp, y), job->clip.x_min, job->clip.x_max);
+    }
+}
+
+// Columns only need work where a vertical run starts or ends : the row where
+// the current run of each column started is kept, and the run is measured
+// when the ink stops
+static void longest_run_cols(void *arg, size_t task)
+{
+    struct rect_job *job = arg;
+    const struct clipped_rect *clip = &job->clip;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range(clip->n_words, job->col_tasks, task, &begin, &end);
+
+    for (int y = clip->y_min; y <= clip->y_max; y++)
+    {
+        const uint64_t *row =
+            (y < clip->y_max) ? bitplane_row(job->bp, y) : NULL;
+        for (size_t i = begin; i < end; i++)
+        {
+            int word_x = 64 * (clip->first_word + (int)i);
+            int bit_min = (clip->x_min > word_x) ? clip->x_min - word_x : 0;
+            int bit_max = (clip->x_max < word_x + 64) ? clip->x_max - word_x
+                                                      : 64;
+            uint64_t current = row ? row[clip->first_word + (int)i] &
+                                         bit_range(bit_min, bit_max)
+                                   : 0;
+
+            for (uint64_t ends = job->previous[i] & ~current; ends;
+                 ends &= ends - 1)
+            {
+                int x = word_x + __builtin_ctzll(ends) - job->rect.x;
+                int run = y - job->run_start[x];
+                job->cols[x] = (run > job->cols[x]) ? run : job->cols[x];
+            }
+            for (uint64_t starts = current & ~job->previous[i]; starts;
+                 starts &= starts - 1)
+            {
+                job->run_start[word_x + __builtin_ctzll(starts) -
+                               job->rect.x] = y;
+            }
+            job->previous[i] = current;
+        }
+    }
+}
+
+bool bitplane_longest_runs(const struct bitplane *bp, SDL_Rect rect, int *rows,
+                           int *cols)
+{
+    if (rows)
+    {
+        memset(rows, 0, (size_t)(rect.h > 0 ? rect.h : 0) * sizeof(*rows));
+    }
+    if (cols)
+    {
+        memset(cols, 0, (size_t)(rect.w > 0 ? rect.w : 0) * sizeof(*cols));
+    }
+    struct rect_job job = {bp, rect, {0}, rows, cols, 0, 0, NULL, NULL};
+    if (!clip_rect(bp, rect, &job.clip))
+    {
+        return true;
+    }
+
+    struct thread_pool *pool = thread_pool_default();
+    if (rows)
+    {
+        job.row_tasks = thread_pool_tasks(
+            pool, (size_t)(job.clip.y_max - job.clip.y_min), ROWS_PER_TASK);
+        thread_pool_run(pool, longest_run_rows, &job, job.row_tasks);
+    }
+    if (!cols)
+    {
+        return true;
+    }
+
+    job.previous = calloc(job.clip.n_words + 1, sizeof(*job.previous));
+    job.run_start = malloc((size_t)rect.w * sizeof(*job.run_start));
+    bool ok = job.previous && job.run_start;
+    if (ok)
+    {
+        job.col_tasks =
+            thread_pool_tasks(pool, job.clip.n_words, WORDS_PER_TASK);
+        thread_pool_run(pool, longest_run_cols, &job, job.col_tasks);
+    }
+    free(job.previous);
+    free(job.run_start);
+    return ok;
+}
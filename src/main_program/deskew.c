@@ -0,0 +1,300 @@
+#include <deskew.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread_pool.h>
+
+/* Search range, size of the downsampled copy and smallest skew corrected */
+#define MAX_SKEW 15.0
+#define MIN_SKEW 0.05
+enum { SAMPLE_SIZE = 1024, ROWS_PER_TASK = 32 };
+
+/* Each level scans +-span around the best angle so far by steps of step,
+ * with one point out of stride (the coarse level doesn't need them all) */
+static const struct {
+    double span;
+    double step;
+    size_t stride;
+} LEVELS[] = {{MAX_SKEW, 1.0, 4}, {1.0, 0.1, 1}, {0.1, 0.02, 1}};
+
+/* Ink of the downsampled copy : one point per factor x factor block of bp
+ * holding any ink */
+struct ink_points {
+    int w;
+    int h;
+    size_t count;
+    int32_t *x;
+    int32_t *y;
+};
+
+static bool push_point(struct ink_points *pts, size_t *capacity, int32_t x,
+                       int32_t y)
+{
+    if (pts->count == *capacity)
+    {
+        size_t new_capacity = *capacity ? 2 * *capacity : 4096;
+        int32_t *xs = realloc(pts->x, new_capacity * sizeof(*xs));
+        if (!xs)
+        {
+            return false;
+        }
+        pts->x = xs;
+        int32_t *ys = realloc(pts->y, new_capacity * sizeof(*ys));
+        if (!ys)
+        {
+            return false;
+        }
+        pts->y = ys;
+        *capacity = new_capacity;
+    }
+    pts->x[pts->count] = x;
+    pts->y[pts->count] = y;
+    pts->count++;
+    return true;
+}
+
+static bool sample_ink(const struct bitplane *bp, struct ink_points *pts)
+{
+    int side = (bp->w > bp->h) ? bp->w : bp->h;
+    int factor = (side + SAMPLE_SIZE - 1) / SAMPLE_SIZE;
+    *pts = (struct ink_points){(bp->w + factor - 1) / factor,
+                               (bp->h + factor - 1) / factor, 0, NULL, NULL};
+    uint64_t *merged = malloc(bp->words_per_row * sizeof(*merged));
+    if (!merged)
+    {
+        return false;
+    }
+
+    // Rows of a block are ORed word by word, then every ink bit of the
+    // result gives the block it falls in
+    size_t capacity = 0;
+    for (int y = 0; y < pts->h; y++)
+    {
+        memset(merged, 0, bp->words_per_row * sizeof(*merged));
+        int y_max = ((y + 1) * factor < bp->h) ? (y + 1) * factor : bp->h;
+        for (int k = y * factor; k < y_max; k++)
+        {
+            const uint64_t *row = bitplane_row(bp, k);
+            for (size_t i = 0; i < bp->words_per_row; i++)
+            {
+                merged[i] |= row[i];
+            }
+        }
+
+        int32_t last = -1;
+        for (size_t i = 0; i < bp->words_per_row; i++)
+        {
+            for (uint64_t bits = merged[i]; bits; bits &= bits - 1)
+            {
+                int32_t x =
+                    (int32_t)(((64 * i) + (size_t)__builtin_ctzll(bits)) /
+                              (size_t)factor);
+                if (x != last && !push_point(pts, &capacity, x, y))
+                {
+                    free(merged);
+                    return false;
+                }
+                last = x;
+            }
+        }
+    }
+    free(merged);
+    return true;
+}
+
+/* Angles of a level, scored by the tasks in parallel */
+struct skew_job {
+    const struct ink_points *pts;
+    const double *angles;
+    double *scores;
+    size_t n_angles;
+    size_t n_tasks;
+    size_t stride;
+    size_t bins;
+    int margin;
+};
+
+/* Sum of the squared row counts once the points are sheared by the angle :
+ * the total is fixed, so the sum of squares grows with the variance */
+static void score_angles(void *arg, size_t task)
+{
+    struct skew_job *job = arg;
+    const struct ink_points *pts = job->pts;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range(job->n_angles, job->n_tasks, task, &begin, &end);
+    uint32_t *profile = malloc(job->bins * sizeof(*profile));
+    if (!profile)
+    {
+        for (size_t a = begin; a < end; a++)
+        {
+            job->scores[a] = 0.0;
+        }
+        return;
+    }
+
+    for (size_t a = begin; a < end; a++)
+    {
+        // row = y - x * tan(angle), in 16.16 fixed point
+        int64_t slope = (int64_t)llround(tan(job->angles[a] * M_PI / 180.0) *
+                                         65536.0);
+        memset(profile, 0, job->bins * sizeof(*profile));
+        for (size_t i = 0; i < pts->count; i += job->stride)
+        {
+            int64_t shift = ((int64_t)pts->x[i] * slope) >> 16;
+            profile[pts->y[i] - shift + job->margin]++;
+        }
+
+        double score = 0.0;
+        for (size_t b = 0; b < job->bins; b++)
+        {
+            score += (double)profile[b] * (double)profile[b];
+        }
+        job->scores[a] = score;
+    }
+    free(profile);
+}
+
+double estimate_skew(const struct bitplane *bp)
+{
+    struct ink_points pts = {0};
+    if (!sample_ink(bp, &pts) || pts.count == 0)
+    {
+        free(pts.x);
+        free(pts.y);
+        return 0.0;
+    }
+
+    size_t n_max = 0;
+    for (size_t l = 0; l < sizeof(LEVELS) / sizeof(*LEVELS); l++)
+    {
+        size_t n = (size_t)lround(2.0 * LEVELS[l].span / LEVELS[l].step) + 1;
+        n_max = (n > n_max) ? n : n_max;
+    }
+    double *angles = malloc(n_max * sizeof(*angles));
+    double *scores = malloc(n_max * sizeof(*scores));
+    struct thread_pool *pool = thread_pool_default();
+    int margin = (int)ceil(pts.w * tan(MAX_SKEW * M_PI / 180.0)) + 2;
+    struct skew_job job = {&pts, angles, scores, 0, 0, 1,
+                           (size_t)(pts.h + (2 * margin)), margin};
+
+    double best = 0.0;
+    for (size_t l = 0; l < sizeof(LEVELS) / sizeof(*LEVELS) && angles && scores;
+         l++)
+    {
+        double center = best;
+        job.n_angles =
+            (size_t)lround(2.0 * LEVELS[l].span / LEVELS[l].step) + 1;
+        for (size_t a = 0; a < job.n_angles; a++)
+        {
+            angles[a] = center - LEVELS[l].span + ((double)a * LEVELS[l].step);
+            angles[a] = (angles[a] > MAX_SKEW) ? MAX_SKEW : angles[a];
+            angles[a] = (angles[a] < -MAX_SKEW) ? -MAX_SKEW : angles[a];
+        }
+        job.n_tasks = thread_pool_tasks(pool, job.n_angles, 1);
+        job.stride = LEVELS[l].stride;
+        thread_pool_run(pool, score_angles, &job, job.n_tasks);
+
+        // Ties go to the angle closest to the previous level's
+        double best_score = -1.0;
+        for (size_t a = 0; a < job.n_angles; a++)
+        {
+            if (scores[a] > best_score ||
+                (scores[a] >= best_score &&
+                 fabs(angles[a] - center) < fabs(best - center)))
+            {
+                best_score = scores[a];
+                best = angles[a];
+            }
+        }
+    }
+
+    free(angles);
+    free(scores);
+    free(pts.x);
+    free(pts.y);
+    return best;
+}
+
+struct rotate_job {
+    const struct bitplane *src;
+    struct bitplane *dst;
+    double cos_a;
+    double sin_a;
+    size_t n_tasks;
+};
+
+// dst (x, y) comes from src (cx + dx cos - dy sin, cy + dx sin + dy cos),
+// dx and dy being relative to the center. Both move by a constant step
+// along a row, in 16.16 fixed point
+static void rotate_strip(void *arg, size_t task)
+{
+    struct rotate_job *job = arg;
+    const struct bitplane *src = job->src;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range((size_t)job->dst->h, job->n_tasks, task, &begin, &end);
+
+    double cx = (src->w - 1) / 2.0;
+    double cy = (src->h - 1) / 2.0;
+    int64_t step_x = llround(job->cos_a * 65536.0);
+    int64_t step_y = llround(job->sin_a * 65536.0);
+    for (size_t y = begin; y < end; y++)
+    {
+        double dy = (double)y - cy;
+        int64_t sx = llround((cx - (cx * job->cos_a) - (dy * job->sin_a) +
+                              0.5) * 65536.0);
+        int64_t sy = llround((cy - (cx * job->sin_a) + (dy * job->cos_a) +
+                              0.5) * 65536.0);
+        uint64_t *out = job->dst->bits + (y * job->dst->words_per_row);
+        for (int x0 = 0; x0 < job->dst->w; x0 += 64)
+        {
+            int n = (job->dst->w - x0 < 64) ? job->dst->w - x0 : 64;
+            uint64_t word = 0;
+            for (int i = 0; i < n; i++, sx += step_x, sy += step_y)
+            {
+                // Negative coordinates floor to negative, both tests catch
+                // them once unsigned
+                uint32_t px = (uint32_t)(sx >> 16);
+                uint32_t py = (uint32_t)(sy >> 16);
+                if (px < (uint32_t)src->w && py < (uint32_t)src->h)
+                {
+                    const uint64_t *row = bitplane_row(src, (int)py);
+                    word |= ((row[px >> 6] >> (px & 63)) & 1) << i;
+                }
+            }
+            out[x0 >> 6] = word;
+        }
+    }
+}
+
+bool bitplane_rotate_alloc(const struct bitplane *src, double degrees,
+                           struct bitplane *dst)
+{
+    if (!bitplane_alloc(src->w, src->h, dst))
+    {
+        return false;
+    }
+
+    struct thread_pool *pool = thread_pool_default();
+    struct rotate_job job = {src, dst, cos(degrees * M_PI / 180.0),
+                             sin(degrees * M_PI / 180.0),
+                             thread_pool_tasks(pool, (size_t)src->h,
+                                               ROWS_PER_TASK)};
+    thread_pool_run(pool, rotate_strip, &job, job.n_tasks);
+    return true;
+}
+
+double deskew_bitplane(struct bitplane *bp)
+{
+    double skew = estimate_skew(bp);
+    struct bitplane rotated = {0};
+    if (fabs(skew) < MIN_SKEW || !bitplane_rotate_alloc(bp, skew, &rotated))
+    {
+        return 0.0;
+    }
+    free_bitplane(bp);
+    *bp = rotated;
+    return skew;
+}
@@ -1,5 +1,7 @@
 #include "../../include/grid_extractor.h"
-#include "../../include/grayscale.h" // Inclusion necessaire pour Otsu
+#include "../../include/bitplane.h"
+#include "../../include/deskew.h"
+#include "../../include/grayscale.h" // Inclusion necessaire pour le seuillage
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <stdio.h>
@@ -9,24 +11,12 @@ enum { MAX_LINES = 100 };
 
 // --- INTERNAL FUNCTIONS ---
 
-static int get_pixel_binary(SDL_Surface *surface, int x, int y)
+static int get_pixel_binary(const struct bitplane *img, int x, int y)
 {
-    if (x < 0 || x >= surface->w || y < 0 || y >= surface->h)
-    {
-        return 1;
-    }
-
-    uint32_t *pixels = (Uint32 *)surface->pixels;
-    uint32_t pixel = pixels[(y * surface->w) + x];
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-    SDL_GetRGB(pixel, surface->format, &r, &g, &b);
-
-    return (r > 128) ? 1 : 0;
+    return bitplane_get(img, x, y) ? 0 : 1;
 }
 
-static void save_sub_image(SDL_Surface *src, SDL_Rect rect,
+static void save_sub_image(const struct bitplane *src, SDL_Rect rect,
                            const char *filename)
 {
     if (rect.w <= 0 || rect.h <= 0)
@@ -34,23 +24,68 @@ static void save_sub_image(SDL_Surface *src, SDL_Rect rect,
 
     SDL_Surface *sub = SDL_CreateRGBSurface(0, rect.w, rect.h, 32, 0x00FF0000,
                                             0x0000FF00, 0x000000FF, 0xFF000000);
+    if (!sub)
+        return;
 
-    SDL_Rect src_rect = rect;
-    SDL_Rect dest_rect = {0, 0, rect.w, rect.h};
+    // Same clipping as SDL_BlitSurface, what's outside of src stays blank
+    for (int y = 0; y < rect.h; y++)
+    {
+        int sy = rect.y + y;
+        if (sy < 0 || sy >= src->h)
+            continue;
+        uint32_t *row = (uint32_t *)(void *)((uint8_t *)sub->pixels +
+                                             ((size_t)y * (size_t)sub->pitch));
+        for (int x = 0; x < rect.w; x++)
+        {
+            int sx = rect.x + x;
+            if (sx < 0 || sx >= src->w)
+                continue;
+            row[x] = bitplane_get(src, sx, sy) ? 0xFF000000 : 0xFFFFFFFF;
+        }
+    }
 
-    SDL_BlitSurface(src, &src_rect, sub, &dest_rect);
     SDL_SaveBMP(sub, filename);
     SDL_FreeSurface(sub);
 }
 
 // --- CORE ---
 
-static void split_grid_and_list(SDL_Surface *img, SDL_Rect *grid_rect,
-                                SDL_Rect *list_rect)
+static void split_grid_and_list(const struct bitplane *img,
+                                SDL_Rect *grid_rect, SDL_Rect *list_rect)
 {
     int width = img->w;
     int height = img->h;
 
+    // Toutes les fenêtres font la hauteur de l'image, donc une seule passe
+    // suffit : projection verticale puis sommes cumulées (col_sums[x] = pixels
+    // noirs des colonnes 0 à x - 1), chaque fenêtre devient une soustraction
+    int *v_proj = calloc((size_t)width, sizeof(int));
+    long *col_sums = malloc(((size_t)width + 1) * sizeof(long));
+    // gap_run[x] : nombre de colonnes quasi blanches consécutives depuis x
+    int *gap_run = malloc(((size_t)width + 1) * sizeof(int));
+    if (!v_proj || !col_sums || !gap_run)
+    {
+        free(v_proj);
+        free(col_sums);
+        free(gap_run);
+        *grid_rect = (SDL_Rect){0, 0, width, height};
+        *list_rect = (SDL_Rect){0, 0, 0, 0};
+        return;
+    }
+
+    bitplane_projections(img, (SDL_Rect){0, 0, width, height}, NULL, v_proj);
+    col_sums[0] = 0;
+    for (int x = 0; x < width; x++)
+    {
+        col_sums[x + 1] = col_sums[x] + v_proj[x];
+    }
+    gap_run[width] = 0;
+    for (int x = width - 1; x >= 0; x--)
+    {
+        // Tolerance of 1%
+        gap_run[x] = (v_proj[x] > height * 0.01) ? 0 : gap_run[x + 1] + 1;
+    }
+
     // Nouvelle logique basée sur la différence de densité
     int best_split_x = -1;
     double best_score = -1.0;
@@ -58,41 +93,18 @@ static void split_grid_and_list(SDL_Surface *img, SDL_Rect *grid_rect,
     // we scan the central zone
     for (int x = width * 0.1; x < width * 0.9; x++)
     {
-        // gap detection (white space)
-        int is_gap = 1;
-        // band of 5 pixels
-        for (int k = 0; k < 5 && (x + k) < width; k++)
-        {
-            int black_pixels = 0;
-            for (int y = 0; y < height; y++)
-            {
-                if (get_pixel_binary(img, x + k, y) == 0)
-                    black_pixels++;
-            }
-            if (black_pixels > height * 0.01) // Tolerance of 1%
-            {
-                is_gap = 0;
-                break;
-            }
-        }
-
-        if (is_gap)
+        // gap detection (white space) : band of 5 pixels
+        int band = (x + 5 < width) ? 5 : width - x;
+        if (gap_run[x] >= band)
         {
             // Calcul du contraste de densité (Gauche vs Droite)
-            long left_pixels = 0, right_pixels = 0;
             int window = 100;
 
             int start_L = (x - window > 0) ? x - window : 0;
-            for (int i = start_L; i < x; i++)
-                for (int j = 0; j < height; j++)
-                    if (get_pixel_binary(img, i, j) == 0)
-                        left_pixels++;
+            long left_pixels = col_sums[x] - col_sums[start_L];
 
             int end_R = (x + window < width) ? x + window : width;
-            for (int i = x; i < end_R; i++)
-                for (int j = 0; j < height; j++)
-                    if (get_pixel_binary(img, i, j) == 0)
-                        right_pixels++;
+            long right_pixels = col_sums[end_R] - col_sums[x];
 
             // Score = Densité Max / Densité Min
             double score = 0;
@@ -114,30 +126,30 @@ static void split_grid_and_list(SDL_Surface *img, SDL_Rect *grid_rect,
     {
         *grid_rect = (SDL_Rect){0, 0, width, height};
         *list_rect = (SDL_Rect){0, 0, 0, 0};
-        return;
-    }
-
-    // Déterminer le coté grille (le plus dense globalement)
-    long left_tot = 0, right_tot = 0;
-    for (int i = 0; i < best_split_x; i++)
-        for (int j = 0; j < height; j++)
-            if (get_pixel_binary(img, i, j) == 0)
-                left_tot++;
-    for (int i = best_split_x; i < width; i++)
-        for (int j = 0; j < height; j++)
-            if (get_pixel_binary(img, i, j) == 0)
-                right_tot++;
-
-    if (right_tot > left_tot)
-    {
-        *list_rect = (SDL_Rect){0, 0, best_split_x, height};
-        *grid_rect = (SDL_Rect){best_split_x, 0, width - best_split_x, height};
     }
     else
     {
-        *grid_rect = (SDL_Rect){0, 0, best_split_x, height};
-        *list_rect = (SDL_Rect){best_split_x, 0, width - best_split_x, height};
+        // Déterminer le coté grille (le plus dense globalement)
+        long left_tot = col_sums[best_split_x];
+        long right_tot = col_sums[width] - col_sums[best_split_x];
+
+        if (right_tot > left_tot)
+        {
+            *list_rect = (SDL_Rect){0, 0, best_split_x, height};
+            *grid_rect =
+                (SDL_Rect){best_split_x, 0, width - best_split_x, height};
+        }
+        else
+        {
+            *grid_rect = (SDL_Rect){0, 0, best_split_x, height};
+            *list_rect =
+                (SDL_Rect){best_split_x, 0, width - best_split_x, height};
+        }
     }
+
+    free(v_proj);
+    free(col_sums);
+    free(gap_run);
 }
 
 // --- FONCTION DE VALIDATION (Anti-Texte) ---
@@ -145,39 +157,18 @@ static void split_grid_and_list(SDL_Surface *img, SDL_Rect *grid_rect,
 // Vérifie si une ligne contient un segment noir assez long pour être une
 // grille. Les lignes de texte sont composées de petits segments (lettres)
 // séparés par du blanc.
-static int is_line_solid(SDL_Surface *img, int pos, int is_horizontal,
-                         SDL_Rect area)
+// Les segments les plus longs de chaque ligne (h_runs) et colonne (v_runs) de
+// la zone sont calculés d'avance en une passe par bitplane_longest_runs, pour
+// ne pas rescanner chaque ligne candidate.
+static int is_line_solid(const int *h_runs, const int *v_runs, int pos,
+                         int is_horizontal, SDL_Rect area)
 {
-    int max_run = 0;     // Longueur max du segment noir continu trouvé
-    int current_run = 0; // Segment actuel
+    // Longueur max du segment noir continu trouvé
+    int max_run = is_horizontal ? h_runs[pos] : v_runs[pos];
 
-    // Définir la longueur à scanner
+    // Longueur scannée
     int limit = is_horizontal ? area.w : area.h;
 
-    // Pour éviter de scanner toute la largeur (lent), on peut scanner le centre
-    // ou scanner toute la ligne. Ici on scanne tout pour la précision.
-    for (int k = 0; k < limit; k++)
-    {
-        int x = is_horizontal ? area.x + k : area.x + pos;
-        int y = is_horizontal ? area.y + pos : area.y + k;
-
-        // Si pixel Noir (attention, get_pixel_binary renvoie 0 pour noir)
-        if (get_pixel_binary(img, x, y) == 0)
-        {
-            current_run++;
-        }
-        else
-        {
-            // Pixel Blanc : fin du segment
-            if (current_run > max_run)
-                max_run = current_run;
-            current_run = 0;
-        }
-    }
-    // Check final (si la ligne finit par du noir)
-    if (current_run > max_run)
-        max_run = current_run;
-
     // HEURISTIQUE MAGIQUE :
     // Une ligne de grille doit avoir un segment continu d'au moins 1/8eme de la
     // taille totale. Une lettre (même un "W" large) dépasse rarement 1/15eme ou
@@ -188,33 +179,33 @@ static int is_line_solid(SDL_Surface *img, int pos, int is_horizontal,
 
 // --- FONCTION PRINCIPALE ---
 
-static void extract_cells(SDL_Surface *img, SDL_Rect grid_rect,
-                          const char *output_folder, int *h_count, int *v_count)
+// Détecte les lignes de la grille, h_lines/v_lines doivent pouvoir contenir
+// MAX_LINES positions (relatives à grid_rect). Renvoie false si la mémoire
+// manque, aucune ligne n'étant alors détectée
+static bool find_grid_lines(const struct bitplane *img, SDL_Rect grid_rect,
+                            int *h_lines, int *h_count, int *v_lines,
+                            int *v_count)
 {
-    if (grid_rect.w <= 0 || grid_rect.h <= 0)
-        return;
+    *h_count = 0;
+    *v_count = 0;
 
     // 1. Histogrammes (Méthode classique)
     int *h_proj = calloc((size_t)grid_rect.h, sizeof(int));
     int *v_proj = calloc((size_t)grid_rect.w, sizeof(int));
+    bitplane_projections(img, grid_rect, h_proj, v_proj);
 
-    for (int y = 0; y < grid_rect.h; y++)
+    int *h_runs = calloc((size_t)grid_rect.h, sizeof(int));
+    int *v_runs = calloc((size_t)grid_rect.w, sizeof(int));
+    if (!h_proj || !v_proj || !h_runs || !v_runs ||
+        !bitplane_longest_runs(img, grid_rect, h_runs, v_runs))
     {
-        for (int x = 0; x < grid_rect.w; x++)
-        {
-            if (get_pixel_binary(img, grid_rect.x + x, grid_rect.y + y) == 0)
-            {
-                h_proj[y]++;
-                v_proj[x]++;
-            }
-        }
+        free(h_proj);
+        free(v_proj);
+        free(h_runs);
+        free(v_runs);
+        return false;
     }
 
-    int h_lines[MAX_LINES];
-    int v_lines[MAX_LINES];
-    *h_count = 0;
-    *v_count = 0;
-
     // SEUILS DE DENSITÉ
     // On garde un seuil bas pour capter les lignes fines de l'image 1
     // La vraie filtration se fera via is_line_solid
@@ -227,7 +218,8 @@ static void extract_cells(SDL_Surface *img, SDL_Rect grid_rect,
     {
         // Condition 1: Densité suffisante
         // Condition 2: Est-ce vraiment une ligne solide et pas du texte ?
-        if (h_proj[y] > thresh_h && is_line_solid(img, y, 1, grid_rect))
+        if (h_proj[y] > thresh_h &&
+            is_line_solid(h_runs, v_runs, y, 1, grid_rect))
         {
             if (start_y == -1)
                 start_y = y; // Début bloc
@@ -264,7 +256,8 @@ static void extract_cells(SDL_Surface *img, SDL_Rect grid_rect,
         if (x < 5)
             continue;
 
-        if (v_proj[x] > thresh_v && is_line_solid(img, x, 0, grid_rect))
+        if (v_proj[x] > thresh_v &&
+            is_line_solid(h_runs, v_runs, x, 0, grid_rect))
         {
             if (start_x == -1)
                 start_x = x;
@@ -289,7 +282,7 @@ static void extract_cells(SDL_Surface *img, SDL_Rect grid_rect,
     if (start_x != -1 && *v_count < MAX_LINES)
     {
         int center = start_x + ((grid_rect.w - 1 - start_x) / 2);
-        if (v_count == 0 || (center - v_lines[*v_count - 1] > 15))
+        if (*v_count == 0 || (center - v_lines[*v_count - 1] > 15))
         {
             v_lines[(*v_count)++] = center;
         }
@@ -298,51 +291,104 @@ static void extract_cells(SDL_Surface *img, SDL_Rect grid_rect,
     printf("DEBUG: Lignes FILTREES detectees -> H: %d, V: %d\n", *h_count,
            *v_count);
 
-    // --- DECOUPAGE ---
-    char filename[512];
-    int cells_saved = 0;
+    free(h_proj);
+    free(v_proj);
+    free(h_runs);
+    free(v_runs);
+    return true;
+}
 
+// Rectangle de la case (i, j) entre les lignes détectées, renvoie 0 si la case
+// est trop petite pour être une vraie case
+static int get_cell_rect(const struct bitplane *img, SDL_Rect grid_rect,
+                         const int *h_lines, const int *v_lines, int i, int j,
+                         SDL_Rect *cell)
+{
     // Offset pour éviter de voir la grille dans la case
     // 2 pixels suffisent généralement
     int offset = 2;
 
+    cell->x = grid_rect.x + v_lines[j] + offset;
+    cell->y = grid_rect.y + h_lines[i] + offset;
+
+    // Calculer la largeur dispo jusqu'à la prochaine ligne
+    int w_available = (v_lines[j + 1] - v_lines[j]);
+    int h_available = (h_lines[i + 1] - h_lines[i]);
+
+    cell->w = w_available - (2 * offset);
+    cell->h = h_available - (2 * offset);
+
+    // Sécurité : taille minimale d'une case (ex: 15x15)
+    // Si c'est trop petit, c'est probablement un reste de bug de
+    // détection
+    if (cell->w < 15 || cell->h < 15)
+        return 0;
+
+    // Sécurité bornes image
+    if (cell->x + cell->w > img->w)
+        cell->w = img->w - cell->x;
+    if (cell->y + cell->h > img->h)
+        cell->h = img->h - cell->y;
+    return 1;
+}
+
+static void extract_cells(const struct bitplane *img, SDL_Rect grid_rect,
+                          const char *output_folder, int *h_count, int *v_count)
+{
+    *h_count = 0;
+    *v_count = 0;
+    if (grid_rect.w <= 0 || grid_rect.h <= 0)
+        return;
+
+    int h_lines[MAX_LINES];
+    int v_lines[MAX_LINES];
+    if (!find_grid_lines(img, grid_rect, h_lines, h_count, v_lines, v_count))
+    {
+        printf("Error finding grid lines: out of memory\n");
+        return;
+    }
+
+    // --- DECOUPAGE ---
+    char filename[512];
+    int cells_saved = 0;
+
     for (int i = 0; i < *h_count - 1; i++)
     {
         for (int j = 0; j < *v_count - 1; j++)
         {
             SDL_Rect cell;
-
-            cell.x = grid_rect.x + v_lines[j] + offset;
-            cell.y = grid_rect.y + h_lines[i] + offset;
-
-            // Calculer la largeur dispo jusqu'à la prochaine ligne
-            int w_available = (v_lines[j + 1] - v_lines[j]);
-            int h_available = (h_lines[i + 1] - h_lines[i]);
-
-            cell.w = w_available - (2 * offset);
-            cell.h = h_available - (2 * offset);
-
-            // Sécurité : taille minimale d'une case (ex: 15x15)
-            // Si c'est trop petit, c'est probablement un reste de bug de
-            // détection
-            if (cell.w < 15 || cell.h < 15)
+            if (!get_cell_rect(img, grid_rect, h_lines, v_lines, i, j, &cell))
                 continue;
 
-            // Sécurité bornes image
-            if (cell.x + cell.w > img->w)
-                cell.w = img->w - cell.x;
-            if (cell.y + cell.h > img->h)
-                cell.h = img->h - cell.y;
-
             sprintf(filename, "%s/cell_%02d_%02d.bmp", output_folder, i, j);
             save_sub_image(img, cell, filename);
             cells_saved++;
         }
     }
     printf("DEBUG: %d cellules sauvegardees.\n", cells_saved);
+}
 
-    free(h_proj);
-    free(v_proj);
+// Copie binarisée (1 = encre) d'une case, pour garder les cases en mémoire
+static void copy_cell(const struct bitplane *img, SDL_Rect rect,
+                      struct cell_image *cell)
+{
+    if (rect.w <= 0 || rect.h <= 0)
+        return;
+
+    cell->pixels = malloc((size_t)rect.w * (size_t)rect.h);
+    if (!cell->pixels)
+        return;
+    cell->w = rect.w;
+    cell->h = rect.h;
+
+    for (int y = 0; y < rect.h; y++)
+    {
+        for (int x = 0; x < rect.w; x++)
+        {
+            cell->pixels[(y * rect.w) + x] =
+                get_pixel_binary(img, rect.x + x, rect.y + y) == 0;
+        }
+    }
 }
 
 // --- EXTRACTION DE LA LISTE (Mots -> Caractères) ---
@@ -350,7 +396,7 @@ static void extract_cells(SDL_Surface *img, SDL_Rect grid_rect,
 // --- FONCTIONS POUR LA LISTE ---
 
 // Fonction récursive pour gérer les lettres collées (ex: "AT", "RV", "LAA")
-static void process_and_save_char(SDL_Surface *img, SDL_Rect rect,
+static void process_and_save_char(const struct bitplane *img, SDL_Rect rect,
                                   const char *output_folder, int word_idx,
                                   int *char_counter)
 {
@@ -385,16 +431,7 @@ static void process_and_save_char(SDL_Surface *img, SDL_Rect rect,
     // --- ANALYSE DE DÉCOUPE ---
 
     int *local_proj = calloc((size_t)rect.w, sizeof(int));
-    for (int x = 0; x < rect.w; x++)
-    {
-        for (int y = 0; y < rect.h; y++)
-        {
-            if (get_pixel_binary(img, rect.x + x, rect.y + y) == 0)
-            {
-                local_proj[x]++;
-            }
-        }
-    }
+    bitplane_projections(img, rect, NULL, local_proj);
 
     int best_split_x = -1;
     int min_density = 99999;
@@ -463,7 +500,8 @@ static void process_and_save_char(SDL_Surface *img, SDL_Rect rect,
                           char_counter);
 }
 
-static void extract_list_characters(SDL_Surface *img, SDL_Rect list_rect,
+static void extract_list_characters(const struct bitplane *img,
+                                    SDL_Rect list_rect,
                                     const char *output_folder)
 {
     if (list_rect.w <= 0 || list_rect.h <= 0)
@@ -473,17 +511,7 @@ static void extract_list_characters(SDL_Surface *img, SDL_Rect list_rect,
 
     // 1. Histogramme Horizontal (Lignes de mots)
     int *h_proj = calloc((size_t)list_rect.h, sizeof(int));
-
-    for (int y = 0; y < list_rect.h; y++)
-    {
-        for (int x = 0; x < list_rect.w; x++)
-        {
-            if (get_pixel_binary(img, list_rect.x + x, list_rect.y + y) == 0)
-            {
-                h_proj[y]++;
-            }
-        }
-    }
+    bitplane_projections(img, list_rect, h_proj, NULL);
 
     int in_word = 0;
     int word_start_y = 0;
@@ -516,17 +544,9 @@ static void extract_list_characters(SDL_Surface *img, SDL_Rect list_rect,
 
         // 2. Histogramme Vertical (Lettres dans le mot)
         int *v_proj = calloc((size_t)list_rect.w, sizeof(int));
-        for (int x = 0; x < list_rect.w; x++)
-        {
-            for (int k = 0; k < word_height; k++)
-            {
-                if (get_pixel_binary(img, list_rect.x + x,
-                                     list_rect.y + word_start_y + k) == 0)
-                {
-                    v_proj[x]++;
-                }
-            }
-        }
+        SDL_Rect word_rect = {list_rect.x, list_rect.y + word_start_y,
+                              list_rect.w, word_height};
+        bitplane_projections(img, word_rect, NULL, v_proj);
 
         int in_char = 0;
         int char_start_x = 0;
@@ -586,6 +606,36 @@ static void extract_list_characters(SDL_Surface *img, SDL_Rect list_rect,
     free(h_proj);
 }
 
+// Conversion Niveaux de gris + seuillage, directement en bitplane, puis
+// redressement si demande
+static bool binarize(SDL_Surface *img, const struct extract_options *options,
+                     struct bitplane *bin)
+{
+    enum threshold_mode mode = options->threshold;
+    struct gray_image gray = {0};
+    uint64_t histogram[256] = {0};
+    if (!grayscale_histogram_alloc(img, &gray, histogram))
+        return false;
+
+    uint8_t threshold = 127; // Deja en noir et blanc apres threshold_local
+    if (mode == THRESHOLD_GLOBAL)
+        threshold = otsu_threshold(histogram);
+    else if (!threshold_local(&gray, mode, 0))
+    {
+        free_gray_image(&gray);
+        return false;
+    }
+
+    bool ok = bitplane_threshold_alloc(&gray, threshold, bin);
+    free_gray_image(&gray);
+    if (ok && options->deskew)
+    {
+        double skew = deskew_bitplane(bin);
+        printf("[GridExtractor] Skew corrected: %.2f deg\n", skew);
+    }
+    return ok;
+}
+
 // --- MAIN FUNCTION ---
 void extract_grid_data(const char *input_path, const char *output_folder,
                        int *h_count, int *v_count)
@@ -597,43 +647,125 @@ void extract_grid_data(const char *input_path, const char *output_folder,
         return;
     }
 
-    // Conversion Niveaux de gris + Otsu
-    SDL_Surface *gray_img = grayscale(img);
+    // Seuillage local : les photos mal eclairees ou penchees passent du
+    // premier coup
+    const struct extract_options options = {THRESHOLD_SAUVOLA, true};
+    struct bitplane bin_img = {0};
+    bool ok = binarize(img, &options, &bin_img);
     SDL_FreeSurface(img);
-
-    uint8_t threshold = get_threshold(gray_img);
-    SDL_Surface *bin_img = apply_threshold(gray_img, threshold);
-    SDL_FreeSurface(gray_img);
-
-    SDL_Surface *fmt_img =
-        SDL_ConvertSurfaceFormat(bin_img, SDL_PIXELFORMAT_RGBA32, 0);
-    SDL_FreeSurface(bin_img);
+    if (!ok)
+    {
+        printf("Error binarizing image (%s): %s\n", input_path,
+               SDL_GetError());
+        return;
+    }
 
     SDL_Rect grid_rect;
     SDL_Rect list_rect;
 
     printf("[GridExtractor] Analyzing image structure...\n");
-    split_grid_and_list(fmt_img, &grid_rect, &list_rect);
+    split_grid_and_list(&bin_img, &grid_rect, &list_rect);
 
     char path[512];
     sprintf(path, "%s/grid_crop.bmp", output_folder);
-    save_sub_image(fmt_img, grid_rect, path);
+    save_sub_image(&bin_img, grid_rect, path);
     printf("[GridExtractor] Grid crop saved.\n");
 
     sprintf(path, "%s/list_crop.bmp", output_folder);
-    save_sub_image(fmt_img, list_rect, path);
+    save_sub_image(&bin_img, list_rect, path);
     printf("[GridExtractor] List crop saved.\n");
 
     printf("[GridExtractor] Extracting cells (Grid)...\n");
 
-    extract_cells(fmt_img, grid_rect, output_folder, h_count, v_count);
+    extract_cells(&bin_img, grid_rect, output_folder, h_count, v_count);
 
     // --- AJOUT ICI ---
     printf("[GridExtractor] Extracting characters (List)...\n");
-    extract_list_characters(fmt_img, list_rect, output_folder);
+    extract_list_characters(&bin_img, list_rect, output_folder);
     // -----------------
 
     printf("[GridExtractor] Extraction complete -> %s.\n", output_folder);
 
-    SDL_FreeSurface(fmt_img);
+    free_bitplane(&bin_img);
+}
+
+bool extract_grid_cells_alloc(SDL_Surface *img,
+                              const struct extract_options *options,
+                              struct grid_cells *grid)
+{
+    *grid = (struct grid_cells){0};
+
+    struct bitplane bin_img = {0};
+    if (!binarize(img, options, &bin_img))
+    {
+        printf("Error binarizing image: %s\n", SDL_GetError());
+        return false;
+    }
+
+    SDL_Rect grid_rect;
+    SDL_Rect list_rect;
+
+    printf("[GridExtractor] Analyzing image structure...\n");
+    split_grid_and_list(&bin_img, &grid_rect, &list_rect);
+
+    int h_lines[MAX_LINES];
+    int v_lines[MAX_LINES];
+    int h_count = 0;
+    int v_count = 0;
+    if (grid_rect.w > 0 && grid_rect.h > 0 &&
+        !find_grid_lines(&bin_img, grid_rect, h_lines, &h_count, v_lines,
+                         &v_count))
+    {
+        printf("Error finding grid lines: out of memory\n");
+        free_bitplane(&bin_img);
+        return false;
+    }
+
+    if (h_count < 2 || v_count < 2)
+    {
+        free_bitplane(&bin_img);
+        return false;
+    }
+
+    grid->rows = h_count - 1;
+    grid->cols = v_count - 1;
+    grid->cells = calloc((size_t)grid->rows * (size_t)grid->cols,
+                         sizeof(*grid->cells));
+    if (!grid->cells)
+    {
+        *grid = (struct grid_cells){0};
+        free_bitplane(&bin_img);
+        return false;
+    }
+
+    for (int i = 0; i < grid->rows; i++)
+    {
+        for (int j = 0; j < grid->cols; j++)
+        {
+            SDL_Rect rect;
+            if (get_cell_rect(&bin_img, grid_rect, h_lines, v_lines, i, j,
+                              &rect))
+            {
+                copy_cell(&bin_img, rect, &grid->cells[(i * grid->cols) + j]);
+            }
+        }
+    }
+
+    printf("[GridExtractor] %dx%d cells kept in memory.\n", grid->rows,
+           grid->cols);
+    free_bitplane(&bin_img);
+    return true;
+}
+
+void free_grid_cells(struct grid_cells *grid)
+{
+    if (grid->cells)
+    {
+        for (int i = 0; i < grid->rows * grid->cols; i++)
+        {
+            free(grid->cells[i].pixels);
+        }
+        free(grid->cells);
+    }
+    *grid = (struct grid_cells){0};
 }
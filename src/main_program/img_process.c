@@ -2,10 +2,16 @@
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_surface.h>
 #include <grayscale.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <thread_pool.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 static inline uint8_t set_bit(int n, uint8_t byte)
 {
@@ -24,54 +30,227 @@ static inline uint8_t change_bit(int n, uint8_t byte, int val)
     return set_bit(n, byte);
 }
 
-SDL_Surface *grayscale(SDL_Surface *src)
+static inline void *surface_row(const SDL_Surface *surface, int y)
 {
-    // Our approach will be to modify this surface
-    SDL_Surface *gray =
-        SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_RGB888, 0);
-    if (!gray)
+    return (uint8_t *)surface->pixels + ((size_t)y * (size_t)surface->pitch);
+}
+
+// Fixed point luma, 0.299 R + 0.587 G + 0.114 B in 1/256th
+enum { LUMA_R = 77, LUMA_G = 150, LUMA_B = 29, LUMA_SHIFT = 8 };
+
+static inline uint8_t luma(uint32_t pixel, const SDL_PixelFormat *fmt)
+{
+    uint32_t r = (pixel >> fmt->Rshift) & 0xFF;
+    uint32_t g = (pixel >> fmt->Gshift) & 0xFF;
+    uint32_t b = (pixel >> fmt->Bshift) & 0xFF;
+    return (uint8_t)(((LUMA_R * r) + (LUMA_G * g) + (LUMA_B * b)) >>
+                     LUMA_SHIFT);
+}
+
+/* Grayscale of a row of n 32 bit pixels with 8 bit channels */
+static void gray_row32(const uint32_t *restrict row, uint8_t *restrict out,
+                       int n, const SDL_PixelFormat *fmt)
+{
+    int x = 0;
+#if defined(__AVX2__)
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    const __m128i rs = _mm_cvtsi32_si128(fmt->Rshift);
+    const __m128i gs = _mm_cvtsi32_si128(fmt->Gshift);
+    const __m128i bs = _mm_cvtsi32_si128(fmt->Bshift);
+    const __m256i kr = _mm256_set1_epi16(LUMA_R);
+    const __m256i kg = _mm256_set1_epi16(LUMA_G);
+    const __m256i kb = _mm256_set1_epi16(LUMA_B);
+    for (; x <= n - 16; x += 16)
     {
-        return NULL;
+        __m256i p0 = _mm256_loadu_si256((const void *)(row + x));
+        __m256i p1 = _mm256_loadu_si256((const void *)(row + x + 8));
+        // Channels as 16 bit lanes, in order 0-3 8-11 4-7 12-15
+        __m256i r = _mm256_packs_epi32(
+            _mm256_and_si256(_mm256_srl_epi32(p0, rs), mask),
+            _mm256_and_si256(_mm256_srl_epi32(p1, rs), mask));
+        __m256i g = _mm256_packs_epi32(
+            _mm256_and_si256(_mm256_srl_epi32(p0, gs), mask),
+            _mm256_and_si256(_mm256_srl_epi32(p1, gs), mask));
+        __m256i b = _mm256_packs_epi32(
+            _mm256_and_si256(_mm256_srl_epi32(p0, bs), mask),
+            _mm256_and_si256(_mm256_srl_epi32(p1, bs), mask));
+        __m256i y = _mm256_add_epi16(
+            _mm256_add_epi16(_mm256_mullo_epi16(r, kr),
+                             _mm256_mullo_epi16(g, kg)),
+            _mm256_mullo_epi16(b, kb));
+        y = _mm256_permute4x64_epi64(_mm256_srli_epi16(y, LUMA_SHIFT), 0xD8);
+        _mm_storeu_si128((void *)(out + x),
+                         _mm_packus_epi16(_mm256_castsi256_si128(y),
+                                          _mm256_extracti128_si256(y, 1)));
+    }
+#elif defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128i rs = _mm_cvtsi32_si128(fmt->Rshift);
+    const __m128i gs = _mm_cvtsi32_si128(fmt->Gshift);
+    const __m128i bs = _mm_cvtsi32_si128(fmt->Bshift);
+    const __m128i kr = _mm_set1_epi16(LUMA_R);
+    const __m128i kg = _mm_set1_epi16(LUMA_G);
+    const __m128i kb = _mm_set1_epi16(LUMA_B);
+    for (; x <= n - 8; x += 8)
+    {
+        __m128i p0 = _mm_loadu_si128((const void *)(row + x));
+        __m128i p1 = _mm_loadu_si128((const void *)(row + x + 4));
+        __m128i r = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(p0, rs), mask),
+                                    _mm_and_si128(_mm_srl_epi32(p1, rs), mask));
+        __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(p0, gs), mask),
+                                    _mm_and_si128(_mm_srl_epi32(p1, gs), mask));
+        __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(p0, bs), mask),
+                                    _mm_and_si128(_mm_srl_epi32(p1, bs), mask));
+        __m128i y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, kr),
+                                                _mm_mullo_epi16(g, kg)),
+                                  _mm_mullo_epi16(b, kb));
+        y = _mm_srli_epi16(y, LUMA_SHIFT);
+        _mm_storel_epi64((void *)(out + x), _mm_packus_epi16(y, y));
+    }
+#endif
+    for (; x < n; x++)
+    {
+        out[x] = luma(row[x], fmt);
     }
-    uint8_t r = 0;
-    uint8_t g = 0;
-    uint8_t b = 0;
+}
 
-    // The RGB888 format is analogous to a uint32_t
-    uint32_t *pixels = gray->pixels;
+/* Same for 24 bit pixels, this one stays scalar as there is no cheap way to
+ * deinterleave 3 byte pixels without SSSE3 */
+static void gray_row24(const uint8_t *restrict row, uint8_t *restrict out,
+                       int n, const SDL_PixelFormat *fmt)
+{
+    for (int x = 0; x < n; x++)
+    {
+        const uint8_t *p = row + (3 * (size_t)x);
+        uint32_t pixel = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                         ((uint32_t)p[2] << 16);
+        out[x] = luma(pixel, fmt);
+    }
+}
 
-    for (int y = 0; y < gray->h; y++)
+/* Counts the row in 4 sub-histograms, so that runs of the same gray (most of
+ * a page is paper) don't serialize on a single counter */
+static void histogram_row(const uint8_t *restrict row, int n,
+                          uint32_t histograms[restrict 4][256])
+{
+    int x = 0;
+    for (; x <= n - 4; x += 4)
     {
-        for (int x = 0; x < gray->w; x++)
-        {
-            uint32_t pixel = pixels[(y * gray->w) + x];
+        histograms[0][row[x]]++;
+        histograms[1][row[x + 1]]++;
+        histograms[2][row[x + 2]]++;
+        histograms[3][row[x + 3]]++;
+    }
+    for (; x < n; x++)
+    {
+        histograms[0][row[x]]++;
+    }
+}
+
+static bool has_byte_channels(const SDL_PixelFormat *fmt)
+{
+    return (fmt->BytesPerPixel == 3 || fmt->BytesPerPixel == 4) &&
+           fmt->palette == NULL && fmt->Rloss == 0 && fmt->Gloss == 0 &&
+           fmt->Bloss == 0;
+}
+
+/* Rows of the image given to each task, and bytes for threshold_gray */
+enum { ROWS_PER_TASK = 32, BYTES_PER_TASK = 1 << 16 };
+
+/* Row strips of grayscale_histogram_alloc, each task counting in its own
+ * sub-histograms */
+struct gray_job {
+    const SDL_Surface *src;
+    struct gray_image *gray;
+    size_t n_tasks;
+    uint32_t (*histograms)[4][256];
+};
 
-            // get color of the pixel with RGB code
-            SDL_GetRGB(pixel, gray->format, &r, &g, &b);
-            // compute the gray
-            uint8_t val = (uint8_t)((0.299 * r) + (0.587 * g) + (0.114 * b));
-            // write new pixel over old one in grey
-            pixels[(y * gray->w) + x] = SDL_MapRGB(gray->format, val, val, val);
+static void gray_strip(void *arg, size_t task)
+{
+    struct gray_job *job = arg;
+    const SDL_Surface *src = job->src;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range((size_t)src->h, job->n_tasks, task, &begin, &end);
+
+    for (size_t y = begin; y < end; y++)
+    {
+        const uint8_t *row = surface_row(src, (int)y);
+        uint8_t *out = job->gray->pixels + (y * (size_t)job->gray->w);
+        if (src->format->BytesPerPixel == 4)
+        {
+            gray_row32((const uint32_t *)(const void *)row, out, src->w,
+                       src->format);
         }
+        else
+        {
+            gray_row24(row, out, src->w, src->format);
+        }
+        histogram_row(out, job->gray->w, job->histograms[task]);
     }
-    return gray; // return new image in grey
 }
 
-uint8_t get_threshold(const SDL_Surface *gray)
+bool grayscale_histogram_alloc(SDL_Surface *src, struct gray_image *gray,
+                               uint64_t histogram[static 256])
 {
-    uint64_t histogram[256] = {0};
+    *gray = (struct gray_image){0};
+    memset(histogram, 0, 256 * sizeof(*histogram));
+
+    // Odd formats (palettes, 16 bit...) are converted once, everything else
+    // is read in place
+    SDL_Surface *converted = NULL;
+    if (!has_byte_channels(src->format))
+    {
+        converted = SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_ARGB8888, 0);
+        if (!converted)
+        {
+            return false;
+        }
+        src = converted;
+    }
+
+    struct thread_pool *pool = thread_pool_default();
+    struct gray_job job = {src, gray,
+                           thread_pool_tasks(pool, (size_t)src->h,
+                                             ROWS_PER_TASK),
+                           NULL};
+    job.histograms = calloc(job.n_tasks, sizeof(*job.histograms));
+    gray->pixels = malloc((size_t)src->w * (size_t)src->h);
+    if (!gray->pixels || !job.histograms)
+    {
+        free(gray->pixels);
+        free(job.histograms);
+        gray->pixels = NULL;
+        SDL_FreeSurface(converted);
+        return false;
+    }
+    gray->w = src->w;
+    gray->h = src->h;
+
+    thread_pool_run(pool, gray_strip, &job, job.n_tasks);
 
-    uint32_t *pixels = (uint32_t *)gray->pixels;
-    uint64_t total_pixels = (size_t)gray->w * (size_t)gray->h;
+    for (size_t t = 0; t < job.n_tasks; t++)
+    {
+        for (size_t i = 0; i < 256; i++)
+        {
+            histogram[i] += (uint64_t)job.histograms[t][0][i] +
+                            job.histograms[t][1][i] + job.histograms[t][2][i] +
+                            job.histograms[t][3][i];
+        }
+    }
 
-    for (size_t i = 0; i < total_pixels; i++)
+    free(job.histograms);
+    SDL_FreeSurface(converted);
+    return true;
+}
+
+uint8_t otsu_threshold(const uint64_t histogram[static 256])
+{
+    uint64_t total_pixels = 0;
+    for (size_t i = 0; i < 256; i++)
     {
-        uint8_t r;
-        uint8_t g;
-        uint8_t b;
-        // Since it's grayscale, r=g=b. We just need one channel.
-        SDL_GetRGB(pixels[i], gray->format, &r, &g, &b);
-        histogram[r]++;
+        total_pixels += histogram[i];
     }
 
     // Otsu's Algorithm Wsh
@@ -122,6 +301,328 @@ uint8_t get_threshold(const SDL_Surface *gray)
     return (uint8_t)threshold;
 }
 
+static void threshold_span(uint8_t *pixels, size_t n, uint8_t threshold)
+{
+    size_t i = 0;
+
+    // No unsigned byte compare before AVX-512, so both sides are shifted by
+    // 0x80 and compared signed
+#if defined(__AVX2__)
+    const __m256i bias = _mm256_set1_epi8((char)0x80);
+    const __m256i tv = _mm256_set1_epi8((char)(threshold ^ 0x80));
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const void *)(pixels + i));
+        v = _mm256_cmpgt_epi8(_mm256_xor_si256(v, bias), tv);
+        _mm256_storeu_si256((void *)(pixels + i), v);
+    }
+#elif defined(__SSE2__)
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    const __m128i tv = _mm_set1_epi8((char)(threshold ^ 0x80));
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const void *)(pixels + i));
+        v = _mm_cmpgt_epi8(_mm_xor_si128(v, bias), tv);
+        _mm_storeu_si128((void *)(pixels + i), v);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        pixels[i] = pixels[i] > threshold ? 255 : 0;
+    }
+}
+
+struct threshold_job {
+    struct gray_image *gray;
+    uint8_t threshold;
+    size_t n_tasks;
+};
+
+static void threshold_strip(void *arg, size_t task)
+{
+    struct threshold_job *job = arg;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range((size_t)job->gray->w * (size_t)job->gray->h, job->n_tasks,
+               task, &begin, &end);
+    threshold_span(job->gray->pixels + begin, end - begin, job->threshold);
+}
+
+void threshold_gray(struct gray_image *gray, uint8_t threshold)
+{
+    struct thread_pool *pool = thread_pool_default();
+    struct threshold_job job = {
+        gray, threshold,
+        thread_pool_tasks(pool, (size_t)gray->w * (size_t)gray->h,
+                          BYTES_PER_TASK)};
+    thread_pool_run(pool, threshold_strip, &job, job.n_tasks);
+}
+
+/* Windows are clamped so that their sums of squares fit in 32 bits */
+enum { MAX_WINDOW = 255, MIN_WINDOW = 15, WINDOW_DIVISOR = 16 };
+
+/* Sauvola : T = m * (1 + k * (s / R - 1)). Bradley : T = m * (1 - t) */
+enum { SAUVOLA_R = 128, BRADLEY_PERCENT = 15 };
+static const float SAUVOLA_K = 0.2F;
+
+/* Ring of the integral rows in use : row k holds the sums of the pixels from
+ * row base to k - 1, left of x (columns < x), for x from 0 to w. Sums are
+ * kept modulo 2^32, window sums are still exact since they fit in 32 bits */
+struct integral_rows {
+    size_t stride;
+    int count;
+    int base;
+    uint32_t *sum;
+    uint32_t *sq;
+};
+
+static void integral_row(const struct gray_image *gray,
+                         struct integral_rows *ir, int k)
+{
+    uint32_t *sum = ir->sum + ((size_t)(k % ir->count) * ir->stride);
+    uint32_t *sq = ir->sq + ((size_t)(k % ir->count) * ir->stride);
+    if (k == ir->base)
+    {
+        memset(sum, 0, ir->stride * sizeof(*sum));
+        memset(sq, 0, ir->stride * sizeof(*sq));
+        return;
+    }
+
+    size_t above = (size_t)((k - 1) % ir->count) * ir->stride;
+    const uint32_t *sum_above = ir->sum + above;
+    const uint32_t *sq_above = ir->sq + above;
+    const uint8_t *row = gray->pixels + ((size_t)(k - 1) * (size_t)gray->w);
+    uint32_t run = 0;
+    uint32_t run_sq = 0;
+    sum[0] = 0;
+    sq[0] = 0;
+    for (int x = 0; x < gray->w; x++)
+    {
+        run += row[x];
+        run_sq += (uint32_t)row[x] * row[x];
+        sum[x + 1] = sum_above[x + 1] + run;
+        sq[x + 1] = sq_above[x + 1] + run_sq;
+    }
+}
+
+/* Row strips of threshold_local, written to out so that every strip reads
+ * the original gray levels around it */
+struct local_job {
+    const struct gray_image *gray;
+    uint8_t *out;
+    enum threshold_mode mode;
+    int r;
+    size_t n_tasks;
+    bool failed;
+};
+
+static void local_strip(void *arg, size_t task)
+{
+    struct local_job *job = arg;
+    const struct gray_image *gray = job->gray;
+    int r = job->r;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range((size_t)gray->h, job->n_tasks, task, &begin, &end);
+
+    // Pixel (x, y) needs the integral rows y - r to y + r + 1
+    struct integral_rows ir = {(size_t)gray->w + 1, (2 * r) + 2,
+                               ((int)begin - r < 0) ? 0 : (int)begin - r,
+                               NULL, NULL};
+    ir.sum = malloc((size_t)ir.count * ir.stride * sizeof(*ir.sum));
+    ir.sq = malloc((size_t)ir.count * ir.stride * sizeof(*ir.sq));
+    if (!ir.sum || !ir.sq)
+    {
+        free(ir.sum);
+        free(ir.sq);
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+
+    int computed = ir.base - 1;
+    for (int y = (int)begin; y < (int)end; y++)
+    {
+        int y0 = (y - r < 0) ? 0 : y - r;
+        int y1 = (y + r + 1 > gray->h) ? gray->h : y + r + 1;
+        while (computed < y1)
+        {
+            integral_row(gray, &ir, ++computed);
+        }
+        size_t top = (size_t)(y0 % ir.count) * ir.stride;
+        size_t bot = (size_t)(y1 % ir.count) * ir.stride;
+        const uint32_t *sum_top = ir.sum + top;
+        const uint32_t *sum_bot = ir.sum + bot;
+        const uint32_t *sq_top = ir.sq + top;
+        const uint32_t *sq_bot = ir.sq + bot;
+
+        const uint8_t *row = gray->pixels + ((size_t)y * (size_t)gray->w);
+        uint8_t *out = job->out + ((size_t)y * (size_t)gray->w);
+        for (int x = 0; x < gray->w; x++)
+        {
+            int x0 = (x - r < 0) ? 0 : x - r;
+            int x1 = (x + r + 1 > gray->w) ? gray->w : x + r + 1;
+            uint32_t n = (uint32_t)((x1 - x0) * (y1 - y0));
+            uint32_t sum =
+                sum_bot[x1] - sum_bot[x0] - sum_top[x1] + sum_top[x0];
+
+            bool ink = false;
+            if (job->mode == THRESHOLD_BRADLEY)
+            {
+                ink = (uint64_t)row[x] * n * 100 <=
+                      (uint64_t)sum * (100 - BRADLEY_PERCENT);
+            }
+            else
+            {
+                uint32_t sq =
+                    sq_bot[x1] - sq_bot[x0] - sq_top[x1] + sq_top[x0];
+                float mean = (float)sum / (float)n;
+                float var = ((float)sq / (float)n) - (mean * mean);
+                float dev = (var > 0.0F) ? sqrtf(var) : 0.0F;
+                float t = mean * (1.0F + (SAUVOLA_K *
+                                          ((dev / SAUVOLA_R) - 1.0F)));
+                ink = (float)row[x] <= t;
+            }
+            out[x] = ink ? 0 : 255;
+        }
+    }
+
+    free(ir.sum);
+    free(ir.sq);
+}
+
+bool threshold_local(struct gray_image *gray, enum threshold_mode mode,
+                     int window)
+{
+    if (mode == THRESHOLD_GLOBAL)
+    {
+        uint32_t sub_histograms[4][256] = {0};
+        for (int y = 0; y < gray->h; y++)
+        {
+            histogram_row(gray->pixels + ((size_t)y * (size_t)gray->w),
+                          gray->w, sub_histograms);
+        }
+        uint64_t histogram[256] = {0};
+        for (size_t i = 0; i < 256; i++)
+        {
+            histogram[i] = (uint64_t)sub_histograms[0][i] +
+                           sub_histograms[1][i] + sub_histograms[2][i] +
+                           sub_histograms[3][i];
+        }
+        threshold_gray(gray, otsu_threshold(histogram));
+        return true;
+    }
+
+    if (window <= 0)
+    {
+        int side = (gray->w < gray->h) ? gray->w : gray->h;
+        window = side / WINDOW_DIVISOR;
+        window = (window < MIN_WINDOW) ? MIN_WINDOW : window;
+    }
+    window = (window > MAX_WINDOW) ? MAX_WINDOW : window;
+
+    // Strips share r rows with their neighbours, they must be a lot taller
+    struct thread_pool *pool = thread_pool_default();
+    int r = window / 2;
+    size_t grain = (size_t)((4 * r) > ROWS_PER_TASK ? 4 * r : ROWS_PER_TASK);
+    struct local_job job = {gray, NULL, mode, r,
+                            thread_pool_tasks(pool, (size_t)gray->h, grain),
+                            false};
+    job.out = malloc((size_t)gray->w * (size_t)gray->h);
+    if (!job.out)
+    {
+        return false;
+    }
+
+    thread_pool_run(pool, local_strip, &job, job.n_tasks);
+    if (job.failed)
+    {
+        free(job.out);
+        return false;
+    }
+    free(gray->pixels);
+    gray->pixels = job.out;
+    return true;
+}
+
+bool binarize_alloc(SDL_Surface *src, enum threshold_mode mode,
+                    struct gray_image *bin)
+{
+    uint64_t histogram[256] = {0};
+    if (!grayscale_histogram_alloc(src, bin, histogram))
+    {
+        return false;
+    }
+    if (mode == THRESHOLD_GLOBAL)
+    {
+        threshold_gray(bin, otsu_threshold(histogram));
+        return true;
+    }
+    if (!threshold_local(bin, mode, 0))
+    {
+        free_gray_image(bin);
+        return false;
+    }
+    return true;
+}
+
+void free_gray_image(struct gray_image *img)
+{
+    free(img->pixels);
+    *img = (struct gray_image){0};
+}
+
+SDL_Surface *grayscale(SDL_Surface *src)
+{
+    // Our approach will be to modify this surface
+    SDL_Surface *gray =
+        SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_RGB888, 0);
+    if (!gray)
+    {
+        return NULL;
+    }
+
+    uint8_t *row_gray = malloc((size_t)gray->w);
+    if (!row_gray)
+    {
+        SDL_FreeSurface(gray);
+        return NULL;
+    }
+
+    const SDL_PixelFormat *fmt = gray->format;
+    for (int y = 0; y < gray->h; y++)
+    {
+        // The RGB888 format is analogous to a uint32_t
+        uint32_t *pixels = surface_row(gray, y);
+        gray_row32(pixels, row_gray, gray->w, fmt);
+        for (int x = 0; x < gray->w; x++)
+        {
+            uint32_t val = row_gray[x];
+            pixels[x] = (val << fmt->Rshift) | (val << fmt->Gshift) |
+                        (val << fmt->Bshift);
+        }
+    }
+
+    free(row_gray);
+    return gray; // return new image in grey
+}
+
+uint8_t get_threshold(const SDL_Surface *gray)
+{
+    uint64_t histogram[256] = {0};
+
+    for (int y = 0; y < gray->h; y++)
+    {
+        const uint32_t *pixels = surface_row(gray, y);
+        for (int x = 0; x < gray->w; x++)
+        {
+            // Since it's grayscale, r=g=b. We just need one channel.
+            histogram[(pixels[x] >> gray->format->Rshift) & 0xFF]++;
+        }
+    }
+
+    return otsu_threshold(histogram);
+}
+
 SDL_Surface *apply_threshold(SDL_Surface *src, uint8_t threshold)
 {
     SDL_Surface *bnw = SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_RGB888, 0);
@@ -130,23 +631,55 @@ SDL_Surface *apply_threshold(SDL_Surface *src, uint8_t threshold)
         return NULL;
     }
 
-    uint32_t *pixels = (uint32_t *)bnw->pixels;
+    const SDL_PixelFormat *fmt = bnw->format;
+    uint32_t white = (0xFFU << fmt->Rshift) | (0xFFU << fmt->Gshift) |
+                     (0xFFU << fmt->Bshift);
     for (int y = 0; y < bnw->h; y++)
     {
+        uint32_t *pixels = surface_row(bnw, y);
         for (int x = 0; x < bnw->w; x++)
         {
-            uint32_t pixel = pixels[(y * bnw->w) + x];
-            uint8_t r = 0;
-            uint8_t g = 0;
-            uint8_t b = 0;
+            // Again, we expect a grayscale so r = g = b
+            uint8_t r = (uint8_t)((pixels[x] >> fmt->Rshift) & 0xFF);
+            pixels[x] = r > threshold ? white : 0;
+        }
+    }
+    return bnw;
+}
+
+SDL_Surface *apply_local_threshold(SDL_Surface *src, enum threshold_mode mode,
+                                   int window)
+{
+    struct gray_image bin = {0};
+    uint64_t histogram[256] = {0};
+    if (!grayscale_histogram_alloc(src, &bin, histogram) ||
+        !threshold_local(&bin, mode, window))
+    {
+        free_gray_image(&bin);
+        return NULL;
+    }
 
-            SDL_GetRGB(pixel, bnw->format, &r, &g, &b);
+    SDL_Surface *bnw = SDL_CreateRGBSurfaceWithFormat(0, bin.w, bin.h, 32,
+                                                      SDL_PIXELFORMAT_RGB888);
+    if (!bnw)
+    {
+        free_gray_image(&bin);
+        return NULL;
+    }
 
-            // Again, we expect a grayscale so r = g = b
-            uint8_t out = r > threshold ? 255 : 0;
-            pixels[(y * bnw->w) + x] = SDL_MapRGB(bnw->format, out, out, out);
+    const SDL_PixelFormat *fmt = bnw->format;
+    uint32_t white = (0xFFU << fmt->Rshift) | (0xFFU << fmt->Gshift) |
+                     (0xFFU << fmt->Bshift);
+    for (int y = 0; y < bnw->h; y++)
+    {
+        uint32_t *pixels = surface_row(bnw, y);
+        const uint8_t *row = bin.pixels + ((size_t)y * (size_t)bin.w);
+        for (int x = 0; x < bnw->w; x++)
+        {
+            pixels[x] = row[x] ? white : 0;
         }
     }
+    free_gray_image(&bin);
     return bnw;
 }
 
@@ -239,3 +772,358 @@ int path_to_bytes(const char path[restrict static 1],
 
     return 1;
 }
+
+/* Overlap, in units of 1/dst_n source pixels, of destination pixel d and
+ * source pixel s when src_n pixels are stretched into dst_n */
+static inline uint32_t overlap(int d, int s, int src_n, int dst_n)
+{
+    int64_t start_d = (int64_t)d * src_n;
+    int64_t start_s = (int64_t)s * dst_n;
+    int64_t end_d = start_d + src_n;
+    int64_t end_s = start_s + dst_n;
+    int64_t start = start_d > start_s ? start_d : start_s;
+    int64_t end = end_d < end_s ? end_d : end_s;
+    return end > start ? (uint32_t)(end - start) : 0;
+}
+
+/* col_sums[x] += weight * row[x], row being 0/1 bytes */
+static void accumulate_row(uint16_t *restrict col_sums,
+                           const uint8_t *restrict row, int n, uint16_t weight)
+{
+    int x = 0;
+#if defined(__AVX2__)
+    const __m256i wv = _mm256_set1_epi16((int16_t)weight);
+    const __m128i ones = _mm_set1_epi8(1);
+    for (; x <= n - 16; x += 16)
+    {
+        __m128i v = _mm_min_epu8(_mm_loadu_si128((const void *)(row + x)),
+                                 ones);
+        __m256i w16 = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(v), wv);
+        __m256i acc = _mm256_loadu_si256((const void *)(col_sums + x));
+        _mm256_storeu_si256((void *)(col_sums + x),
+                            _mm256_add_epi16(acc, w16));
+    }
+#elif defined(__SSE2__)
+    const __m128i wv = _mm_set1_epi16((int16_t)weight);
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i zero = _mm_setzero_si128();
+    for (; x <= n - 16; x += 16)
+    {
+        __m128i v = _mm_min_epu8(_mm_loadu_si128((const void *)(row + x)),
+                                 ones);
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), wv);
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), wv);
+        __m128i *acc = (__m128i *)(void *)(col_sums + x);
+        _mm_storeu_si128(acc, _mm_add_epi16(_mm_loadu_si128(acc), lo));
+        _mm_storeu_si128(acc + 1, _mm_add_epi16(_mm_loadu_si128(acc + 1), hi));
+    }
+#endif
+    for (; x < n; x++)
+    {
+        col_sums[x] = (uint16_t)(col_sums[x] + (row[x] ? weight : 0));
+    }
+}
+
+int resize_to_bytes(const uint8_t *restrict src, size_t pitch, int src_w,
+                    int src_h, uint_fast8_t bytes[restrict static 1], int h,
+                    int w)
+{
+    // col_sums never exceeds src_h, see below
+    if (src_w <= 0 || src_h <= 0 || src_h > UINT16_MAX)
+    {
+        return 0;
+    }
+
+    uint16_t *col_sums = malloc((size_t)src_w * sizeof(*col_sums));
+    if (!col_sums)
+    {
+        return 0;
+    }
+
+    // Area of a destination pixel, in units of 1/(w*h) source pixels
+    uint64_t area = (uint64_t)src_w * (uint64_t)src_h;
+
+    for (int y = 0; y < h; y++)
+    {
+        // Vertical pass : every source row overlapping this output row, with
+        // its overlap as weight. The weights of a row add up to src_h.
+        memset(col_sums, 0, (size_t)src_w * sizeof(*col_sums));
+        int sy_start = (int)(((int64_t)y * src_h) / h);
+        int sy_end = (int)((((int64_t)y + 1) * src_h - 1) / h);
+        for (int sy = sy_start; sy <= sy_end; sy++)
+        {
+            accumulate_row(col_sums, src + ((size_t)sy * pitch), src_w,
+                           (uint16_t)overlap(y, sy, src_h, h));
+        }
+
+        // Horizontal pass on the column sums
+        for (int x = 0; x < w; x++)
+        {
+            int sx_start = (int)(((int64_t)x * src_w) / w);
+            int sx_end = (int)((((int64_t)x + 1) * src_w - 1) / w);
+            uint64_t ink = 0;
+            for (int sx = sx_start; sx <= sx_end; sx++)
+            {
+                ink += (uint64_t)col_sums[sx] * overlap(x, sx, src_w, w);
+            }
+            // Same as thresholding the resized gray at 254 like
+            // path_to_bytes : any pixel with some ink in it is ink
+            bytes[x + (y * w)] = (255 * ink) >= area ? 1 : 0;
+        }
+    }
+
+    free(col_sums);
+    return 1;
+}
+
+/* Bilinear blend of the 2x2 pixels at p, fx and fy being the weights (out of
+ * 256) of the right and bottom ones. Channels are blended separately, the
+ * SIMD and scalar versions round the same way */
+static inline uint32_t bilinear_pixel(const uint32_t *p, size_t stride,
+                                      uint32_t fx, uint32_t fy)
+{
+#if defined(__SSE2__)
+    // One 16 bit lane per channel, left pixel in the low half : every
+    // product and sum stays under 256 * 256
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wx = _mm_set_epi16((int16_t)fx, (int16_t)fx, (int16_t)fx,
+                                     (int16_t)fx, (int16_t)(256 - fx),
+                                     (int16_t)(256 - fx), (int16_t)(256 - fx),
+                                     (int16_t)(256 - fx));
+    __m128i top = _mm_mullo_epi16(
+        _mm_unpacklo_epi8(_mm_loadl_epi64((const void *)p), zero), wx);
+    __m128i bot = _mm_mullo_epi16(
+        _mm_unpacklo_epi8(_mm_loadl_epi64((const void *)(p + stride)), zero),
+        wx);
+    top = _mm_srli_epi16(_mm_add_epi16(top, _mm_srli_si128(top, 8)), 8);
+    bot = _mm_srli_epi16(_mm_add_epi16(bot, _mm_srli_si128(bot, 8)), 8);
+
+    __m128i v = _mm_add_epi16(
+        _mm_mullo_epi16(top, _mm_set1_epi16((int16_t)(256 - fy))),
+        _mm_mullo_epi16(bot, _mm_set1_epi16((int16_t)fy)));
+    v = _mm_srli_epi16(v, 8);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(v, zero));
+#else
+    uint32_t out = 0;
+    for (uint32_t shift = 0; shift < 32; shift += 8)
+    {
+        uint32_t a = (p[0] >> shift) & 0xFF;
+        uint32_t b = (p[1] >> shift) & 0xFF;
+        uint32_t c = (p[stride] >> shift) & 0xFF;
+        uint32_t d = (p[stride + 1] >> shift) & 0xFF;
+        uint32_t top = ((a * (256 - fx)) + (b * fx)) >> 8;
+        uint32_t bot = ((c * (256 - fx)) + (d * fx)) >> 8;
+        out |= (((top * (256 - fy)) + (bot * fy)) >> 8) << shift;
+    }
+    return out;
+#endif
+}
+
+/* src with a 1 pixel white border, so that the 2x2 block of any point of src
+ * can be read without clamping */
+struct rotate_job {
+    const uint32_t *padded;
+    size_t stride;
+    int src_w;
+    int src_h;
+    SDL_Surface *dst;
+    double cos_a;
+    double sin_a;
+    bool fits_32; // Coordinates and offsets fit in 32 bits, for gathers
+    size_t n_tasks;
+};
+
+#if defined(__AVX2__)
+/* Channels 0 and 2 (or 1 and 3) of 8 pixels in 16 bit lanes, blended like
+ * bilinear_pixel with weights w_a and w_b (both halves of a lane) */
+static inline __m256i blend_lanes(__m256i a, __m256i b, __m256i w_a,
+                                  __m256i w_b)
+{
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(a, w_a),
+                                              _mm256_mullo_epi16(b, w_b)),
+                             8);
+}
+
+/* Same as the scalar loop of rotate_strip for 8 pixels at a time, the 2x2
+ * blocks being gathered. Out of src, nothing is loaded and the white the
+ * gathers start from blends into white. Returns the pixels done */
+static int rotate_row8(const struct rotate_job *job, uint32_t *out, int n,
+                       int64_t sx, int64_t sy, int64_t step_x, int64_t step_y)
+{
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i dx = _mm256_mullo_epi32(lanes,
+                                          _mm256_set1_epi32((int32_t)step_x));
+    const __m256i dy = _mm256_mullo_epi32(lanes,
+                                          _mm256_set1_epi32((int32_t)step_y));
+    const __m256i white = _mm256_set1_epi32(-1);
+    const __m256i low = _mm256_set1_epi32(0x00FF00FF);
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    const __m256i full = _mm256_set1_epi32(0x01000100);
+    const __m256i max_x = _mm256_set1_epi32(job->src_w + 1);
+    const __m256i max_y = _mm256_set1_epi32(job->src_h + 1);
+    const __m256i stride = _mm256_set1_epi32((int32_t)job->stride);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+    const int *base = (const int *)(const void *)job->padded;
+
+    int x = 0;
+    for (; x <= n - 8; x += 8, sx += 8 * step_x, sy += 8 * step_y)
+    {
+        __m256i vx = _mm256_add_epi32(_mm256_set1_epi32((int32_t)sx), dx);
+        __m256i vy = _mm256_add_epi32(_mm256_set1_epi32((int32_t)sy), dy);
+        __m256i x0 = _mm256_srai_epi32(vx, 16);
+        __m256i y0 = _mm256_srai_epi32(vy, 16);
+        __m256i valid = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(x0, minus_one),
+                             _mm256_cmpgt_epi32(max_x, x0)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(y0, minus_one),
+                             _mm256_cmpgt_epi32(max_y, y0)));
+        __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32(y0, stride), x0);
+        idx = _mm256_and_si256(idx, valid);
+
+        __m256i p[4] = {
+            _mm256_mask_i32gather_epi32(white, base, idx, valid, 4),
+            _mm256_mask_i32gather_epi32(white, base + 1, idx, valid, 4),
+            _mm256_mask_i32gather_epi32(white, base + job->stride, idx, valid,
+                                        4),
+            _mm256_mask_i32gather_epi32(white, base + job->stride + 1, idx,
+                                        valid, 4),
+        };
+
+        // Weights out of 256, copied in both 16 bit halves
+        __m256i fx = _mm256_and_si256(_mm256_srli_epi32(vx, 8), byte);
+        __m256i fy = _mm256_and_si256(_mm256_srli_epi32(vy, 8), byte);
+        fx = _mm256_or_si256(fx, _mm256_slli_epi32(fx, 16));
+        fy = _mm256_or_si256(fy, _mm256_slli_epi32(fy, 16));
+        __m256i fx_inv = _mm256_sub_epi16(full, fx);
+        __m256i fy_inv = _mm256_sub_epi16(full, fy);
+
+        __m256i even[4];
+        __m256i odd[4];
+        for (int k = 0; k < 4; k++)
+        {
+            even[k] = _mm256_and_si256(p[k], low);
+            odd[k] = _mm256_and_si256(_mm256_srli_epi32(p[k], 8), low);
+        }
+        __m256i v_even =
+            blend_lanes(blend_lanes(even[0], even[1], fx_inv, fx),
+                        blend_lanes(even[2], even[3], fx_inv, fx), fy_inv, fy);
+        __m256i v_odd =
+            blend_lanes(blend_lanes(odd[0], odd[1], fx_inv, fx),
+                        blend_lanes(odd[2], odd[3], fx_inv, fx), fy_inv, fy);
+        _mm256_storeu_si256((void *)(out + x),
+                            _mm256_or_si256(v_even,
+                                            _mm256_slli_epi32(v_odd, 8)));
+    }
+    return x;
+}
+#endif
+
+// dst (x, y) comes from src (cx + dx cos + dy sin, cy - dx sin + dy cos), dx
+// and dy being relative to the center of dst. Both move by a constant step
+// along a row, in 16.16 fixed point
+static void rotate_strip(void *arg, size_t task)
+{
+    struct rotate_job *job = arg;
+    SDL_Surface *dst = job->dst;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range((size_t)dst->h, job->n_tasks, task, &begin, &end);
+
+    double cx = (job->src_w - 1) / 2.0;
+    double cy = (job->src_h - 1) / 2.0;
+    double dcx = (dst->w - 1) / 2.0;
+    double dcy = (dst->h - 1) / 2.0;
+    int64_t step_x = llround(job->cos_a * 65536.0);
+    int64_t step_y = llround(-job->sin_a * 65536.0);
+    uint32_t white = 0xFFFFFFFFU;
+
+    for (size_t y = begin; y < end; y++)
+    {
+        double dy = (double)y - dcy;
+        // + 1 for the border of padded
+        int64_t sx = llround((cx + 1.0 - (dcx * job->cos_a) +
+                              (dy * job->sin_a)) * 65536.0);
+        int64_t sy = llround((cy + 1.0 + (dcx * job->sin_a) +
+                              (dy * job->cos_a)) * 65536.0);
+        uint32_t *out = surface_row(dst, (int)y);
+        int x = 0;
+#if defined(__AVX2__)
+        if (job->fits_32)
+        {
+            x = rotate_row8(job, out, dst->w, sx, sy, step_x, step_y);
+            sx += x * step_x;
+            sy += x * step_y;
+        }
+#endif
+        for (; x < dst->w; x++, sx += step_x, sy += step_y)
+        {
+            int64_t x0 = sx >> 16;
+            int64_t y0 = sy >> 16;
+            if (x0 < 0 || y0 < 0 || x0 > job->src_w || y0 > job->src_h)
+            {
+                out[x] = white;
+                continue;
+            }
+            const uint32_t *p = job->padded + ((size_t)y0 * job->stride) +
+                                (size_t)x0;
+            out[x] = bilinear_pixel(p, job->stride, (uint32_t)(sx >> 8) & 0xFF,
+                                    (uint32_t)(sy >> 8) & 0xFF);
+        }
+    }
+}
+
+SDL_Surface *rotate_surface_alloc(SDL_Surface *src, double degrees)
+{
+    SDL_Surface *argb = SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_ARGB8888,
+                                                 0);
+    if (!argb)
+    {
+        return NULL;
+    }
+
+    struct rotate_job job = {NULL, (size_t)argb->w + 2, argb->w, argb->h,
+                             NULL, cos(degrees * M_PI / 180.0),
+                             sin(degrees * M_PI / 180.0), false, 0};
+    uint32_t *padded =
+        malloc(job.stride * ((size_t)argb->h + 2) * sizeof(*padded));
+    if (!padded)
+    {
+        SDL_FreeSurface(argb);
+        return NULL;
+    }
+    memset(padded, 0xFF, job.stride * ((size_t)argb->h + 2) * sizeof(*padded));
+    for (int y = 0; y < argb->h; y++)
+    {
+        memcpy(padded + (((size_t)y + 1) * job.stride) + 1,
+               surface_row(argb, y), (size_t)argb->w * sizeof(*padded));
+    }
+    SDL_FreeSurface(argb);
+    job.padded = padded;
+
+    // Bounding box of the turned image, rounded so that a null angle gives
+    // back the same size
+    double w = (fabs(job.cos_a) * job.src_w) + (fabs(job.sin_a) * job.src_h);
+    double h = (fabs(job.sin_a) * job.src_w) + (fabs(job.cos_a) * job.src_h);
+    job.dst = SDL_CreateRGBSurfaceWithFormat(0, (int)ceil(w - 1e-6),
+                                             (int)ceil(h - 1e-6), 32,
+                                             SDL_PIXELFORMAT_ARGB8888);
+    if (!job.dst)
+    {
+        free(padded);
+        return NULL;
+    }
+
+    // 16.16 coordinates stay under 1.5 times the largest side, offsets under
+    // the size of padded
+    int side = (job.dst->w > job.dst->h) ? job.dst->w : job.dst->h;
+    side = (side > job.src_w + 2) ? side : job.src_w + 2;
+    side = (side > job.src_h + 2) ? side : job.src_h + 2;
+    job.fits_32 = side < (1 << 14) &&
+                  job.stride * ((size_t)job.src_h + 2) < (size_t)INT32_MAX;
+
+    struct thread_pool *pool = thread_pool_default();
+    job.n_tasks = thread_pool_tasks(pool, (size_t)job.dst->h, ROWS_PER_TASK);
+    thread_pool_run(pool, rotate_strip, &job, job.n_tasks);
+    free(padded);
+    return job.dst;
+}
@@ -1,11 +1,17 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
+#include <components.h>
 #include <locating.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <thread_pool.h>
 
 enum { BLACK = 0, WHITE = 255 };
 
+// Zones smaller than this are labeled on a single thread
+enum { PARALLEL_MIN_PIXELS = 1 << 22 };
+
 uint8_t get_pixel(SDL_Surface *img, int x, int y) {
   if (x < 0 || x >= img->w || y < 0 || y >= img->h) {
     return 0;
@@ -91,52 +97,146 @@ SDL_Rect detect_grid(SDL_Surface *img, int *proj_x, int *proj_y) {
   return grid;
 }
 
-void flood_fill(SDL_Surface *img, int x, int y, struct bounding_box *bb) {
-  if (x < 0 || y < 0 || x >= img->w || y >= img->h) {
-    return;
+// Pixels waiting to be filled, grows as needed instead of recursing
+struct fill_stack {
+  struct {
+    int x;
+    int y;
+  } *points;
+  size_t count;
+  size_t capacity;
+};
+
+static bool push_point(struct fill_stack *stack, int x, int y) {
+  if (stack->count == stack->capacity) {
+    size_t capacity = stack->capacity ? 2 * stack->capacity : 64;
+    void *points = realloc(stack->points, capacity * sizeof(*stack->points));
+    if (!points) {
+      return false;
+    }
+    stack->points = points;
+    stack->capacity = capacity;
   }
-  if (get_pixel(img, x, y) != BLACK) {
+  stack->points[stack->count].x = x;
+  stack->points[stack->count].y = y;
+  stack->count++;
+  return true;
+}
+
+// Scanline fill : a whole horizontal span is filled at once, and only the
+// first pixel of each span above and below is pushed
+void flood_fill(SDL_Surface *img, int x, int y, struct bounding_box *bb) {
+  struct fill_stack stack = {0};
+  if (x < 0 || y < 0 || x >= img->w || y >= img->h ||
+      get_pixel(img, x, y) != BLACK || !push_point(&stack, x, y)) {
     return;
   }
 
-  // Mark as visited
-  set_pixel(img, x, y, WHITE);
+  while (stack.count > 0) {
+    stack.count--;
+    int px = stack.points[stack.count].x;
+    int py = stack.points[stack.count].y;
+    if (get_pixel(img, px, py) != BLACK) {
+      continue;
+    }
 
-  if (x < bb->x_min) {
-    bb->x_min = x;
-  }
-  if (y < bb->y_min) {
-    bb->y_min = y;
+    int left = px;
+    while (left > 0 && get_pixel(img, left - 1, py) == BLACK) {
+      left--;
+    }
+    int right = px;
+    while (right < img->w - 1 && get_pixel(img, right + 1, py) == BLACK) {
+      right++;
+    }
+
+    // Mark as visited
+    for (int i = left; i <= right; i++) {
+      set_pixel(img, i, py, WHITE);
+    }
+    bb->x_min = (left < bb->x_min) ? left : bb->x_min;
+    bb->x_max = (right > bb->x_max) ? right : bb->x_max;
+    bb->y_min = (py < bb->y_min) ? py : bb->y_min;
+    bb->y_max = (py > bb->y_max) ? py : bb->y_max;
+
+    for (int ny = py - 1; ny <= py + 1; ny += 2) {
+      if (ny < 0 || ny >= img->h) {
+        continue;
+      }
+      for (int i = left; i <= right; i++) {
+        bool span_start = get_pixel(img, i, ny) == BLACK &&
+                          (i == left || get_pixel(img, i - 1, ny) != BLACK);
+        if (span_start && !push_point(&stack, i, ny)) {
+          free(stack.points);
+          return;
+        }
+      }
+    }
   }
-  if (x > bb->x_max) {
-    bb->x_max = x;
+  free(stack.points);
+}
+
+// Black pixels of zone as ink
+static bool surface_to_bitplane(SDL_Surface *zone, struct bitplane *bp) {
+  if (!bitplane_alloc(zone->w, zone->h, bp)) {
+    return false;
   }
-  if (y > bb->y_max) {
-    bb->y_max = y;
+  for (int y = 0; y < zone->h; y++) {
+    uint64_t *row = bp->bits + ((size_t)y * bp->words_per_row);
+    for (int x = 0; x < zone->w; x++) {
+      row[x >> 6] |= (uint64_t)(get_pixel(zone, x, y) == BLACK) << (x & 63);
+    }
   }
+  return true;
+}
 
-  flood_fill(img, x + 1, y, bb);
-  flood_fill(img, x - 1, y, bb);
-  flood_fill(img, x, y + 1, bb);
-  flood_fill(img, x, y - 1, bb);
+// Saves the bounding box of a component, without the other components that
+// may overlap it
+static void save_component(SDL_Surface *zone, const struct components *cc,
+                           uint32_t label, const char *filename) {
+  const struct bounding_box *bb = &cc->stats[label - 1].bb;
+  SDL_Surface *img =
+      SDL_CreateRGBSurface(0, bb->x_max - bb->x_min + 1,
+                           bb->y_max - bb->y_min + 1, 8, 0, 0, 0, 0);
+  if (!img) {
+    return;
+  }
+  if (zone->format->palette) {
+    SDL_SetSurfacePalette(img, zone->format->palette);
+  }
+  for (int y = 0; y < img->h; y++) {
+    const uint32_t *labels =
+        cc->labels + ((size_t)(bb->y_min + y) * (size_t)cc->w) + bb->x_min;
+    for (int x = 0; x < img->w; x++) {
+      set_pixel(img, x, y, (labels[x] == label) ? BLACK : WHITE);
+    }
+  }
+  IMG_SavePNG(img, filename);
+  SDL_FreeSurface(img);
 }
 
 // Extracts each character as a sub-image
 void extract_characters(SDL_Surface *zone, const char *folder) {
-  int count = 0;
-  for (int y = 0; y < zone->h; y++) {
-    for (int x = 0; x < zone->w; x++) {
-      if (get_pixel(zone, x, y) == BLACK) {
-        struct bounding_box bb = {x, y, x, y};
-        flood_fill(zone, x, y, &bb);
-        SDL_Rect letter = {bb.x_min, bb.y_min, bb.x_max - bb.x_min + 1,
-                           bb.y_max - bb.y_min + 1};
-
-        char filename[128];
-        (void)sprintf(filename, "%s/char_%03d.png", folder, count++);
-        save_image(zone, letter, filename);
-      }
-    }
+  struct bitplane bp = {0};
+  struct components cc = {0};
+  struct thread_pool *pool = thread_pool_default();
+  size_t pixels = (size_t)zone->w * (size_t)zone->h;
+  size_t threads =
+      (pixels >= PARALLEL_MIN_PIXELS && pool) ? pool->threads : 1;
+
+  if (!surface_to_bitplane(zone, &bp) ||
+      !label_components_alloc(&bp, threads, &cc)) {
+    free_bitplane(&bp);
+    (void)fprintf(stderr, "Could not label the characters\n");
+    return;
+  }
+  free_bitplane(&bp);
+
+  // Labels are already in the order the characters were met row by row
+  for (uint32_t label = 1; label <= cc.count; label++) {
+    char filename[128];
+    (void)sprintf(filename, "%s/char_%03u.png", folder, label - 1);
+    save_component(zone, &cc, label, filename);
   }
-  printf("Extracted %d character(s)\n", count);
+  printf("Extracted %zu character(s)\n", cc.count);
+  free_components(&cc);
 }
@@ -1,5 +1,8 @@
+#include "grayscale.h"
 #include "grid_extractor.h"
 #include "neural.h"
+#include "recognize.h"
+#include "thread_pool.h"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_error.h>
 #include <SDL2/SDL_image.h>
@@ -9,7 +12,7 @@
 #include <err.h>
 #include <stdbool.h>
 #include <stdio.h>
-#include <sys/stat.h>
+#include <stdlib.h>
 
 #define ROTATE_INCREMENT 1.5
 enum { UI_W = 220, BTN_W = 160, BTN_H = 60 };
@@ -20,8 +23,10 @@ static bool point_in_rect(int x, int y, SDL_Rect *r)
     return x >= r->x && x <= r->x + r->w && y >= r->y && y <= r->y + r->h;
 }
 
+/* The decoded image is kept in img for the extraction, the texture is only
+ * there to display it */
 static void load_image(SDL_Renderer *ren, const char *path, SDL_Texture **tex,
-                       int *iw, int *ih)
+                       SDL_Surface **img)
 {
     SDL_Surface *surf = IMG_Load(path);
     if (!surf)
@@ -42,37 +47,38 @@ static void load_image(SDL_Renderer *ren, const char *path, SDL_Texture **tex,
     {
         SDL_DestroyTexture(*tex);
     }
+    SDL_FreeSurface(*img);
 
     *tex = new_tex;
-    *iw = surf->w;
-    *ih = surf->h;
-
-    SDL_FreeSurface(surf);
-    printf("loaded %s (%dx%d)\n", path, *iw, *ih);
+    *img = surf;
+    printf("loaded %s (%dx%d)\n", path, surf->w, surf->h);
 }
 
-static int save_screenshot(SDL_Renderer *ren, const char *filename,
-                           SDL_Rect image_area)
+static SDL_Surface *screenshot_alloc(SDL_Renderer *ren, SDL_Rect image_area)
 {
-    int w;
-    int h;
-    if (SDL_GetRendererOutputSize(ren, &w, &h) != 0)
-    {
-        return -1;
-    }
-
     SDL_Surface *shot = SDL_CreateRGBSurfaceWithFormat(
         0, image_area.w, image_area.h, 32, SDL_PIXELFORMAT_ARGB8888);
     if (!shot)
     {
-        return -2;
+        return NULL;
     }
 
     if (SDL_RenderReadPixels(ren, &image_area, SDL_PIXELFORMAT_ARGB8888,
                              shot->pixels, shot->pitch) != 0)
     {
         SDL_FreeSurface(shot);
-        return -3;
+        return NULL;
+    }
+    return shot;
+}
+
+static int save_screenshot(SDL_Renderer *ren, const char *filename,
+                           SDL_Rect image_area)
+{
+    SDL_Surface *shot = screenshot_alloc(ren, image_area);
+    if (!shot)
+    {
+        return -1;
     }
 
     int rc = SDL_SaveBMP(shot, filename);
@@ -183,41 +189,63 @@ static void destroy_video(SDL_Window *win, SDL_Renderer *ren, TTF_Font *font)
     SDL_Quit();
 }
 
-static void on_button_pressed(SDL_Renderer *ren, SDL_Rect image_area)
+static void on_button_pressed(const struct neural_model *model,
+                              SDL_Surface *img, double angle)
 {
-    mkdir(".cache/", 0777);
-    mkdir(".cache/grid/", 0777);
-
-    save_screenshot(ren, ".cache/saved", image_area);
+    if (!img)
+    {
+        warnx("No image loaded");
+        return;
+    }
+    if (!model->params)
+    {
+        warnx("No weights loaded, train the network first");
+        return;
+    }
 
-    int height = 0;
-    int width = 0;
-    extract_grid_data(".cache/saved", ".cache/grid", &height, &width);
-    height -= 1;
-    width -= 1;
+    // The angle of the arrow keys is applied to the full resolution image,
+    // deskewing then takes care of what is left
+    SDL_Surface *turned = rotate_surface_alloc(img, angle);
+    if (!turned)
+    {
+        warnx("rotate_surface_alloc: %s", SDL_GetError());
+        return;
+    }
 
-    struct neural_network nn = {0};
-    neural_load_weights(&nn, "weights.bin");
+    const struct extract_options options = {THRESHOLD_SAUVOLA, true};
+    struct grid_cells grid = {0};
+    bool found = extract_grid_cells_alloc(turned, &options, &grid);
+    SDL_FreeSurface(turned);
+    if (!found)
+    {
+        warnx("No grid found in the image");
+        return;
+    }
 
-    static const char *path_name = ".cache/grid/cell_%02d_%02d.bmp";
-    system("mogrify -background white -resize 32x32^! "
-           ".cache/grid/*");
+    char *letters = malloc((size_t)grid.rows * (size_t)grid.cols);
+    if (!letters)
+    {
+        warnx("Out of memory");
+        free_grid_cells(&grid);
+        return;
+    }
+    recognize_grid(model, &grid, letters);
 
-    printf("%d %d\n", height, width);
-    for (int i = 0; i < height; ++i)
+    printf("%d %d\n", grid.rows, grid.cols);
+    for (int i = 0; i < grid.rows; ++i)
     {
-        for (int j = 0; j < width; ++j)
-        {
-            char path[256] = {0};
-            (void)snprintf(path, 256, path_name, i, j);
-            (void)putchar(neural_find_logic(&nn, path));
-        }
+        (void)fwrite(letters + ((size_t)i * (size_t)grid.cols), 1,
+                     (size_t)grid.cols, stdout);
         (void)putchar('\n');
     }
+
+    free(letters);
+    free_grid_cells(&grid);
 }
 
-static bool event_loop(SDL_Renderer *ren, double *angle, SDL_Texture **tex,
-                       int *iw, int *ih, SDL_Rect image_area)
+static bool event_loop(SDL_Renderer *ren, const struct neural_model *model,
+                       double *angle, SDL_Texture **tex, SDL_Surface **img,
+                       SDL_Rect image_area)
 {
     SDL_Event e;
     while (SDL_PollEvent(&e))
@@ -230,7 +258,7 @@ static bool event_loop(SDL_Renderer *ren, double *angle, SDL_Texture **tex,
         if (e.type == SDL_DROPFILE)
         {
             char *file = e.drop.file;
-            load_image(ren, file, tex, iw, ih);
+            load_image(ren, file, tex, img);
             SDL_free(file);
             continue;
         }
@@ -242,7 +270,7 @@ static bool event_loop(SDL_Renderer *ren, double *angle, SDL_Texture **tex,
 
             if (point_in_rect(mx, my, &solve_btn))
             {
-                on_button_pressed(ren, image_area);
+                on_button_pressed(model, *img, *angle);
             }
         }
 
@@ -314,23 +342,36 @@ static void draw_ui(SDL_Renderer *ren, SDL_Texture *tex, TTF_Font *font,
 
 int main(int argc, char **argv)
 {
+    // Optional second argument : threads of the image stages, all the cores
+    // by default
+    if (argc >= 3)
+    {
+        thread_pool_set_default(strtoul(argv[2], NULL, 10));
+    }
+
     SDL_Window *win;
     SDL_Renderer *ren;
     TTF_Font *font;
     init_video(&win, &ren, &font);
 
     SDL_Texture *tex = NULL;
-    int iw = 0;
-    int ih = 0;
+    SDL_Surface *img = NULL;
     if (argc >= 2)
     {
-        load_image(ren, argv[1], &tex, &iw, &ih);
+        load_image(ren, argv[1], &tex, &img);
     }
     else
     {
         printf("No image argument. Drag & drop an image onto the window.\n");
     }
 
+    // Loaded once for every click, and shared by whatever classifies cells
+    struct neural_model model = {0};
+    if (!neural_model_load_alloc("weights.bin", &model))
+    {
+        warnx("Could not load weights.bin");
+    }
+
     bool running = true;
     double angle = 0.0;
     while (running)
@@ -341,14 +382,17 @@ int main(int argc, char **argv)
         SDL_Rect image_area = {0, 0, ww - UI_W, wh};
         SDL_Rect ui_area = {ww - UI_W, 0, UI_W, wh};
 
-        running = event_loop(ren, &angle, &tex, &iw, &ih, image_area);
-        draw_ui(ren, tex, font, image_area, ui_area, ih, iw, angle);
+        running = event_loop(ren, &model, &angle, &tex, &img, image_area);
+        draw_ui(ren, tex, font, image_area, ui_area, img ? img->h : 0,
+                img ? img->w : 0, angle);
     }
 
     if (tex)
     {
         SDL_DestroyTexture(tex);
     }
+    SDL_FreeSurface(img);
+    free_neural_model(&model);
     destroy_video(win, ren, font);
     return 0;
 }
@@ -1,12 +1,17 @@
+#include <math.h>
 #include <matrix.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <threads.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-void shuffle(uint_fast8_t array[static 1], size_t count) {
-  for (size_t i = 0; i < count - 1; i++) {
-    size_t j = i + ((size_t)random() % (count - i));
-    uint_fast8_t temp = array[i];
+void shuffle(size_t array[], size_t count, struct rng *rng) {
+  for (size_t i = 0; i + 1 < count; i++) {
+    size_t j = i + rng_below(rng, count - i);
+    size_t temp = array[i];
     array[i] = array[j];
     array[j] = temp;
   }
@@ -51,19 +56,221 @@ double line_dot8(const uint_fast8_t a[restrict static 1],
     return sum;
 }
 
-void line_map(double a[restrict static 1], size_t n, double (*f)(double))
+void line_subi(double a[restrict static 1], const double b[restrict static 1],
+               size_t n)
 {
     for (size_t i = 0; i < n; ++i)
     {
-        a[i] = f(a[i]);
+        a[i] -= b[i];
     }
 }
 
-void line_subi(double a[restrict static 1], const double b[restrict static 1],
-               size_t n)
+size_t line_nonzero(const uint_fast8_t a[restrict static 1], size_t n,
+                    uint16_t idx[restrict static 1])
 {
+    // Every index is written, only those of non zero entries are kept
+    size_t count = 0;
     for (size_t i = 0; i < n; ++i)
     {
-        a[i] -= b[i];
+        idx[count] = (uint16_t)i;
+        count += (a[i] != 0);
+    }
+    return count;
+}
+
+double line_sum_at(const double a[restrict static 1],
+                   const uint16_t idx[restrict], size_t n)
+{
+    double sum = 0;
+    for (size_t k = 0; k < n; ++k)
+    {
+        sum += a[idx[k]];
+    }
+    return sum;
+}
+
+void line_add_at(double a[restrict static 1], const uint16_t idx[restrict],
+                 size_t n, double v)
+{
+    for (size_t k = 0; k < n; ++k)
+    {
+        a[idx[k]] += v;
+    }
+}
+
+void line_sum_rows(double out[restrict],
+                   const double rows[restrict], size_t width,
+                   const uint16_t idx[restrict], size_t n_idx)
+{
+    // A block of out stays in registers while the rows go through it, each
+    // column being summed in the order of idx like the scalar tail does
+    size_t j = 0;
+#if defined(__AVX2__)
+    for (; j + 16 <= width; j += 16)
+    {
+        __m256d s0 = _mm256_setzero_pd();
+        __m256d s1 = _mm256_setzero_pd();
+        __m256d s2 = _mm256_setzero_pd();
+        __m256d s3 = _mm256_setzero_pd();
+        for (size_t k = 0; k < n_idx; ++k)
+        {
+            const double *row = rows + ((size_t)idx[k] * width) + j;
+            s0 = _mm256_add_pd(s0, _mm256_loadu_pd(row));
+            s1 = _mm256_add_pd(s1, _mm256_loadu_pd(row + 4));
+            s2 = _mm256_add_pd(s2, _mm256_loadu_pd(row + 8));
+            s3 = _mm256_add_pd(s3, _mm256_loadu_pd(row + 12));
+        }
+        _mm256_storeu_pd(out + j, s0);
+        _mm256_storeu_pd(out + j + 4, s1);
+        _mm256_storeu_pd(out + j + 8, s2);
+        _mm256_storeu_pd(out + j + 12, s3);
+    }
+#elif defined(__SSE2__)
+    for (; j + 8 <= width; j += 8)
+    {
+        __m128d s0 = _mm_setzero_pd();
+        __m128d s1 = _mm_setzero_pd();
+        __m128d s2 = _mm_setzero_pd();
+        __m128d s3 = _mm_setzero_pd();
+        for (size_t k = 0; k < n_idx; ++k)
+        {
+            const double *row = rows + ((size_t)idx[k] * width) + j;
+            s0 = _mm_add_pd(s0, _mm_loadu_pd(row));
+            s1 = _mm_add_pd(s1, _mm_loadu_pd(row + 2));
+            s2 = _mm_add_pd(s2, _mm_loadu_pd(row + 4));
+            s3 = _mm_add_pd(s3, _mm_loadu_pd(row + 6));
+        }
+        _mm_storeu_pd(out + j, s0);
+        _mm_storeu_pd(out + j + 2, s1);
+        _mm_storeu_pd(out + j + 4, s2);
+        _mm_storeu_pd(out + j + 6, s3);
+    }
+#endif
+    for (; j < width; ++j)
+    {
+        double sum = 0;
+        for (size_t k = 0; k < n_idx; ++k)
+        {
+            sum += rows[((size_t)idx[k] * width) + j];
+        }
+        out[j] = sum;
+    }
+}
+
+/* exp for line_sigmoid : x = k ln2 + r with |r| <= ln2 / 2, then exp(r)
+ * from its Taylor series and 2^k put straight into the exponent bits. k is
+ * rounded by conversions rather than by adding 1.5 * 2^52, which
+ * -ffast-math would be free to fold away */
+#define EXP_LIMIT 700.0 // Keeps 2^k a normal double
+#define LOG2E 1.4426950408889634
+#define LN2_HI 6.93145751953125e-1 // ln2 split for an exact k * LN2_HI
+#define LN2_LO 1.42860682030941723212e-6
+
+static const double EXP_COEFFS[] = {
+    1.0,
+    1.0,
+    1.0 / 2.0,
+    1.0 / 6.0,
+    1.0 / 24.0,
+    1.0 / 120.0,
+    1.0 / 720.0,
+    1.0 / 5040.0,
+    1.0 / 40320.0,
+    1.0 / 362880.0,
+    1.0 / 3628800.0,
+    1.0 / 39916800.0,
+    1.0 / 479001600.0,
+    1.0 / 6227020800.0,
+};
+
+#if EXP_DEGREE < 3 || EXP_DEGREE > 13
+#error "EXP_DEGREE must be between 3 and 13"
+#endif
+
+static inline double exp_poly(double x)
+{
+    x = (x > EXP_LIMIT) ? EXP_LIMIT : x;
+    x = (x < -EXP_LIMIT) ? -EXP_LIMIT : x;
+    int32_t k = (int32_t)lrint(x * LOG2E);
+    double r = (x - ((double)k * LN2_HI)) - ((double)k * LN2_LO);
+
+    double p = EXP_COEFFS[EXP_DEGREE];
+    for (int i = EXP_DEGREE - 1; i >= 0; --i)
+    {
+        p = (p * r) + EXP_COEFFS[i];
+    }
+
+    uint64_t bits = (uint64_t)(k + 1023) << 52;
+    double scale = 0;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+void line_sigmoid(double a[restrict], size_t n)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256d one = _mm256_set1_pd(1.0);
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256d x = _mm256_sub_pd(_mm256_setzero_pd(), _mm256_loadu_pd(a + i));
+        x = _mm256_min_pd(x, _mm256_set1_pd(EXP_LIMIT));
+        x = _mm256_max_pd(x, _mm256_set1_pd(-EXP_LIMIT));
+        __m128i k = _mm256_cvtpd_epi32(_mm256_mul_pd(x, _mm256_set1_pd(LOG2E)));
+        __m256d kd = _mm256_cvtepi32_pd(k);
+        __m256d r = _mm256_sub_pd(x, _mm256_mul_pd(kd, _mm256_set1_pd(LN2_HI)));
+        r = _mm256_sub_pd(r, _mm256_mul_pd(kd, _mm256_set1_pd(LN2_LO)));
+
+        __m256d p = _mm256_set1_pd(EXP_COEFFS[EXP_DEGREE]);
+        for (int j = EXP_DEGREE - 1; j >= 0; --j)
+        {
+            p = _mm256_add_pd(_mm256_mul_pd(p, r),
+                              _mm256_set1_pd(EXP_COEFFS[j]));
+        }
+
+        __m256i bits = _mm256_cvtepi32_epi64(
+            _mm_add_epi32(k, _mm_set1_epi32(1023)));
+        __m256d scale = _mm256_castsi256_pd(_mm256_slli_epi64(bits, 52));
+        __m256d e = _mm256_mul_pd(p, scale);
+        _mm256_storeu_pd(a + i, _mm256_div_pd(one, _mm256_add_pd(one, e)));
+    }
+#elif defined(__SSE2__)
+    const __m128d one = _mm_set1_pd(1.0);
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128d x = _mm_sub_pd(_mm_setzero_pd(), _mm_loadu_pd(a + i));
+        x = _mm_min_pd(x, _mm_set1_pd(EXP_LIMIT));
+        x = _mm_max_pd(x, _mm_set1_pd(-EXP_LIMIT));
+        __m128i k = _mm_cvtpd_epi32(_mm_mul_pd(x, _mm_set1_pd(LOG2E)));
+        __m128d kd = _mm_cvtepi32_pd(k);
+        __m128d r = _mm_sub_pd(x, _mm_mul_pd(kd, _mm_set1_pd(LN2_HI)));
+        r = _mm_sub_pd(r, _mm_mul_pd(kd, _mm_set1_pd(LN2_LO)));
+
+        __m128d p = _mm_set1_pd(EXP_COEFFS[EXP_DEGREE]);
+        for (int j = EXP_DEGREE - 1; j >= 0; --j)
+        {
+            p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(EXP_COEFFS[j]));
+        }
+
+        // k + 1023 is positive, zero extending it is enough
+        __m128i bits = _mm_unpacklo_epi32(
+            _mm_add_epi32(k, _mm_set1_epi32(1023)), _mm_setzero_si128());
+        __m128d scale = _mm_castsi128_pd(_mm_slli_epi64(bits, 52));
+        __m128d e = _mm_mul_pd(p, scale);
+        _mm_storeu_pd(a + i, _mm_div_pd(one, _mm_add_pd(one, e)));
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        a[i] = 1.0 / (1.0 + exp_poly(-a[i]));
+    }
+}
+
+void line_dsigmoid_mul(double d[restrict static 1],
+                       const double a[restrict static 1], size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        d[i] *= a[i] * (1.0 - a[i]);
     }
 }
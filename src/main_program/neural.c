@@ -1,9 +1,12 @@
 #include "neural.h"
 #include "grayscale.h"
-#include <assert.h>
+#include <dataset.h>
 #include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <math.h>
 #include <matrix.h>
+#include <rng.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -12,19 +15,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread_pool.h>
 #include <threads.h>
 #include <time.h>
+#include <unistd.h>
 
 #define countof(A) (sizeof(A) / sizeof(*A))
 
-static double sigmoid(double x)
-{
-    return 1.0 / (1.0 + exp(-x));
-}
-static double dsigmoid(double x)
-{
-    return x * (1 - x);
-}
 /* static double relu(double x) */
 /* { */
 /*     return x >= 0 ? x : 0; */
@@ -34,15 +33,140 @@ static double dsigmoid(double x)
 /*     return x >= 0 ? 1 : 0; */
 /* } */
 
-static double rnd(void)
+static double rnd(struct rng *rng)
+{
+    return rng_double(rng) - 0.5;
+}
+
+/* Start of a weights file, struct neural_params following at params_offset.
+ * byte_order is WEIGHTS_BYTE_ORDER as the writer stored it, so it reads
+ * differently on a machine of the other endianness */
+#define WEIGHTS_MAGIC "AUXNNWT"
+enum {
+    WEIGHTS_VERSION = 1,
+    WEIGHTS_BYTE_ORDER = 0x01020304,
+    WEIGHTS_FLOAT64 = 1, // IEEE 754 binary64
+};
+
+struct weights_header {
+    char magic[8]; // WEIGHTS_MAGIC, NUL included
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t dtype;
+    uint32_t sizes[4]; // INPUT_SIZE, LAYER1_SIZE, LAYER2_SIZE, OUTPUT_SIZE
+    uint32_t params_offset;
+    uint64_t params_size;
+    uint64_t checksum; // FNV-1a of the params_size bytes of the params
+    uint64_t reserved;
+};
+
+/* Weights files from before the header : a raw copy of the struct
+ * neural_network of the time, activations included */
+struct legacy_network {
+    uint_fast8_t input[INPUT_SIZE];
+    double layer1[LAYER1_SIZE];
+    double layer2[LAYER2_SIZE];
+    double output[OUTPUT_SIZE];
+
+    double layer1_biases[LAYER1_SIZE];
+    double layer2_biases[LAYER2_SIZE];
+    double output_biases[OUTPUT_SIZE];
+
+    double layer1_weights[LAYER1_SIZE][INPUT_SIZE];
+    double layer2_weights[LAYER2_SIZE][LAYER1_SIZE];
+    double output_weights[OUTPUT_SIZE][LAYER2_SIZE];
+};
+
+static uint64_t fnv1a(const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Params of the size bytes of a weights file in the current format, NULL if
+ * it isn't one or doesn't fit this build */
+static const struct neural_params *header_params(const void *data, size_t size)
+{
+    const struct weights_header *header = data;
+    const uint32_t sizes[4] = {INPUT_SIZE, LAYER1_SIZE, LAYER2_SIZE,
+                               OUTPUT_SIZE};
+    if (size < sizeof(*header) ||
+        memcmp(header->magic, WEIGHTS_MAGIC, sizeof(WEIGHTS_MAGIC)) != 0 ||
+        header->version != WEIGHTS_VERSION ||
+        header->byte_order != WEIGHTS_BYTE_ORDER ||
+        header->dtype != WEIGHTS_FLOAT64 ||
+        memcmp(header->sizes, sizes, sizeof(sizes)) != 0 ||
+        header->params_size != sizeof(struct neural_params) ||
+        header->params_offset % 64 != 0 ||
+        header->params_offset < sizeof(*header) ||
+        header->params_offset > size ||
+        size - header->params_offset < sizeof(struct neural_params))
+    {
+        return NULL;
+    }
+
+    const struct neural_params *params =
+        (const void *)((const uint8_t *)data + header->params_offset);
+    if (fnv1a(params, sizeof(*params)) != header->checksum)
+    {
+        return NULL;
+    }
+    return params;
+}
+
+/* Maps the whole file at path read only */
+static bool map_file(const char path[static 1], void **map, size_t *size)
 {
-    return ((double)random() / ((double)(1ULL << 31) - 1.0)) - 0.5;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    struct stat st = {0};
+    if (fstat(fd, &st) == -1 || st.st_size <= 0)
+    {
+        (void)close(fd);
+        return false;
+    }
+    *size = (size_t)st.st_size;
+    *map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    return *map != MAP_FAILED;
 }
 
-static double (*output_func)(double) = sigmoid;
-static double (*output_delta)(double) = dsigmoid;
-static double (*hidden_func)(double) = sigmoid;
-static double (*hidden_delta)(double) = dsigmoid;
+bool neural_weights_map_alloc(const char path[static 1],
+                              struct neural_weights *weights)
+{
+    *weights = (struct neural_weights){0};
+    void *map = NULL;
+    size_t size = 0;
+    if (!map_file(path, &map, &size))
+    {
+        return false;
+    }
+    const struct neural_params *params = header_params(map, size);
+    if (!params)
+    {
+        (void)munmap(map, size);
+        return false;
+    }
+    *weights = (struct neural_weights){params, map, size};
+    return true;
+}
+
+void free_neural_weights(struct neural_weights *weights)
+{
+    if (weights->map)
+    {
+        (void)munmap(weights->map, weights->map_size);
+    }
+    *weights = (struct neural_weights){0};
+}
 
 void neural_save_weights(struct neural_network *nn, const char path[static 1])
 {
@@ -51,7 +175,20 @@ void neural_save_weights(struct neural_network *nn, const char path[static 1])
     {
         errx(1, "Could not open file %s", path);
     }
-    if (fwrite(nn, sizeof(*nn), 1, fileptr) != 1)
+
+    // The params come right after the header, which is 64 bytes long
+    struct weights_header header = {
+        WEIGHTS_MAGIC,
+        WEIGHTS_VERSION,
+        WEIGHTS_BYTE_ORDER,
+        WEIGHTS_FLOAT64,
+        {INPUT_SIZE, LAYER1_SIZE, LAYER2_SIZE, OUTPUT_SIZE},
+        sizeof(header),
+        sizeof(nn->params),
+        fnv1a(&nn->params, sizeof(nn->params)),
+        0};
+    if (fwrite(&header, sizeof(header), 1, fileptr) != 1 ||
+        fwrite(&nn->params, sizeof(nn->params), 1, fileptr) != 1)
     {
         perror("Error while writing weights!");
         goto cleanup;
@@ -64,99 +201,217 @@ cleanup:
     }
 }
 
+/* Whether the size bytes at data are a weights file of the old format */
+static bool is_legacy(const void *data, size_t size)
+{
+    return size == sizeof(struct legacy_network) &&
+           memcmp(data, WEIGHTS_MAGIC, sizeof(WEIGHTS_MAGIC)) != 0;
+}
+
+static void load_legacy(struct neural_params *params,
+                        const struct legacy_network *old)
+{
+    memcpy(params->layer1_biases, old->layer1_biases,
+           sizeof(old->layer1_biases));
+    memcpy(params->layer2_biases, old->layer2_biases,
+           sizeof(old->layer2_biases));
+    memcpy(params->output_biases, old->output_biases,
+           sizeof(old->output_biases));
+    memcpy(params->layer1_weights, old->layer1_weights,
+           sizeof(old->layer1_weights));
+    memcpy(params->layer2_weights, old->layer2_weights,
+           sizeof(old->layer2_weights));
+    memcpy(params->output_weights, old->output_weights,
+           sizeof(old->output_weights));
+}
+
 void neural_load_weights(struct neural_network *nn, const char path[static 1])
 {
-    FILE *fileptr = fopen(path, "rb");
-    if (fileptr == NULL)
+    void *map = NULL;
+    size_t size = 0;
+    if (!map_file(path, &map, &size))
     {
         errx(1, "Could not open file %s", path);
     }
-    if (fseek(fileptr, 0, SEEK_END) == -1)
+
+    const struct neural_params *params = header_params(map, size);
+    if (params)
     {
-        perror("Could not fseek to end of weights file");
-        goto cleanup;
+        nn->params = *params;
     }
-    (void)fseek(fileptr, 0, SEEK_SET);
-    if (fread(nn, sizeof(*nn), 1, fileptr) != 1)
+    else if (is_legacy(map, size))
     {
-        perror("Error while reading weights!");
-        goto cleanup;
+        load_legacy(&nn->params, map);
+    }
+    else
+    {
+        errx(1, "%s is not a weights file for this network, or is corrupted",
+             path);
     }
+    (void)munmap(map, size);
+}
 
-cleanup:
-    if (fclose(fileptr) != 0)
+bool neural_model_load_alloc(const char path[static 1],
+                             struct neural_model *model)
+{
+    *model = (struct neural_model){0};
+    if (neural_weights_map_alloc(path, &model->weights))
     {
-        perror("Error while closing weight file!");
-        thrd_exit(1);
+        model->params = model->weights.params;
+    }
+    else
+    {
+        // Old files can't be used in place, their layout isn't ours
+        void *map = NULL;
+        size_t size = 0;
+        if (!map_file(path, &map, &size))
+        {
+            return false;
+        }
+        void *copy = NULL;
+        if (is_legacy(map, size) &&
+            posix_memalign(&copy, 64, sizeof(*model->copy)) == 0)
+        {
+            model->copy = copy;
+            load_legacy(model->copy, map);
+            model->params = model->copy;
+        }
+        (void)munmap(map, size);
+    }
+
+    model->layer1_columns =
+        malloc(INPUT_SIZE * sizeof(*model->layer1_columns));
+    if (!model->params || !model->layer1_columns)
+    {
+        free_neural_model(model);
+        return false;
     }
+    for (size_t i = 0; i < LAYER1_SIZE; ++i)
+    {
+        for (size_t j = 0; j < INPUT_SIZE; ++j)
+        {
+            model->layer1_columns[j][i] = model->params->layer1_weights[i][j];
+        }
+    }
+    return true;
+}
+
+void free_neural_model(struct neural_model *model)
+{
+    free_neural_weights(&model->weights);
+    free(model->copy);
+    free(model->layer1_columns);
+    *model = (struct neural_model){0};
 }
 
 /* This macro could not have been replaced by a static inline func, as it relies
  * on what would otherwise be variable sizes. */
-#define RAND_INIT_LAYER(lay, lay_biases, lay_weight, layprev)                  \
+#define RAND_INIT_LAYER(rng, lay, lay_biases, lay_weight, layprev)             \
     do                                                                         \
     {                                                                          \
         for (size_t i = 0; i < countof(lay); ++i)                              \
         {                                                                      \
-            (lay_biases)[i] = rnd();                                           \
-            (lay)[i] = rnd();                                                  \
+            (lay_biases)[i] = rnd(rng);                                        \
+            (lay)[i] = rnd(rng);                                               \
             for (size_t j = 0; j < countof(layprev); ++j)                      \
             {                                                                  \
-                (lay_weight)[i][j] = rnd();                                    \
+                (lay_weight)[i][j] = rnd(rng);                                 \
             }                                                                  \
         }                                                                      \
     } while (0)
 
-static void randomize_layers(struct neural_network *nn)
+static void randomize_layers(struct neural_network *nn, struct rng *rng)
 {
-    RAND_INIT_LAYER(nn->layer1, nn->layer1_biases, nn->layer1_weights,
-                    nn->input);
-    RAND_INIT_LAYER(nn->layer2, nn->layer2_biases, nn->layer2_weights,
-                    nn->layer1);
-    RAND_INIT_LAYER(nn->output, nn->output_biases, nn->output_weights,
-                    nn->layer2);
+    struct neural_params *params = &nn->params;
+    struct neural_workspace *ws = &nn->ws;
+    RAND_INIT_LAYER(rng, ws->layer1, params->layer1_biases,
+                    params->layer1_weights, ws->input);
+    RAND_INIT_LAYER(rng, ws->layer2, params->layer2_biases,
+                    params->layer2_weights, ws->layer1);
+    RAND_INIT_LAYER(rng, ws->output, params->output_biases,
+                    params->output_weights, ws->layer2);
 }
 
-static void forward_pass(struct neural_network *nn,
-                         const uint_fast8_t input[static INPUT_SIZE])
+/* Layers after the first, once ws->layer1 holds its weighted sums */
+static void forward_hidden(const struct neural_params *params,
+                           struct neural_workspace *ws)
 {
-    /* memset(nn->layer1, 0, sizeof(nn->layer1)); */
-    /* memset(nn->layer2, 0, sizeof(nn->layer2)); */
-    /* memset(nn->output, 0, sizeof(nn->output)); */
+    line_subi(ws->layer1, params->layer1_biases, LAYER1_SIZE);
+    line_sigmoid(ws->layer1, LAYER1_SIZE);
 
-    memcpy(nn->input, input, sizeof(nn->input));
+    for (size_t i = 0; i < LAYER2_SIZE; ++i)
+    {
+        double dot =
+            line_dot(ws->layer1, params->layer2_weights[i], LAYER1_SIZE);
+        ws->layer2[i] = dot - params->layer2_biases[i];
+    }
+    line_sigmoid(ws->layer2, LAYER2_SIZE);
 
-    // We then compute the product
-    for (size_t i = 0; i < LAYER1_SIZE; ++i)
+    for (size_t i = 0; i < OUTPUT_SIZE; ++i)
     {
-        double dot = line_dot8(nn->input, nn->layer1_weights[i], INPUT_SIZE);
-        nn->layer1[i] = dot - nn->layer1_biases[i];
+        double dot =
+            line_dot(ws->layer2, params->output_weights[i], LAYER2_SIZE);
+        ws->output[i] = dot - params->output_biases[i];
     }
+    line_sigmoid(ws->output, OUTPUT_SIZE);
+}
 
-    line_map(nn->layer1, LAYER1_SIZE, hidden_func);
+/* Copies input to ws and lists its ink pixels */
+static void set_input(struct neural_workspace *ws,
+                      const uint_fast8_t input[static INPUT_SIZE])
+{
+    memcpy(ws->input, input, sizeof(ws->input));
+    ws->n_active = line_nonzero(ws->input, INPUT_SIZE, ws->active);
+}
 
-    for (size_t i = 0; i < LAYER2_SIZE; ++i)
+/* Training pass : layer1_weights changes after every step, so the ink
+ * pixels are picked from its rows instead of from layer1_columns */
+static void forward_pass(const struct neural_params *params,
+                         struct neural_workspace *ws,
+                         const uint_fast8_t input[static INPUT_SIZE])
+{
+    set_input(ws, input);
+
+    // We then compute the product
+    for (size_t i = 0; i < LAYER1_SIZE; ++i)
     {
-        double dot = line_dot(nn->layer1, nn->layer2_weights[i], LAYER1_SIZE);
-        nn->layer2[i] = dot - nn->layer2_biases[i];
+        ws->layer1[i] =
+            line_sum_at(params->layer1_weights[i], ws->active, ws->n_active);
     }
-    line_map(nn->layer2, LAYER2_SIZE, hidden_func);
+    forward_hidden(params, ws);
+}
 
-    for (size_t i = 0; i < OUTPUT_SIZE; ++i)
+char neural_find_input(const struct neural_model *model,
+                       struct neural_workspace *ws,
+                       const uint_fast8_t input[static INPUT_SIZE])
+{
+    // A cell is mostly paper, so only the layer1_columns of its ink pixels
+    // are summed
+    set_input(ws, input);
+    line_sum_rows(ws->layer1, &model->layer1_columns[0][0], LAYER1_SIZE,
+                  ws->active, ws->n_active);
+    forward_hidden(model->params, ws);
+
+    return (char)('a' + max_i(ws->output, countof(ws->output)));
+}
+
+void neural_find_batch(const struct neural_model *model,
+                       struct neural_workspace *ws, size_t n,
+                       const uint_fast8_t inputs[][INPUT_SIZE], char letters[])
+{
+    for (size_t i = 0; i < n; ++i)
     {
-        double dot = line_dot(nn->layer2, nn->output_weights[i], LAYER2_SIZE);
-        nn->output[i] = dot - nn->output_biases[i];
+        letters[i] = neural_find_input(model, ws, inputs[i]);
     }
-    line_map(nn->output, OUTPUT_SIZE, output_func);
 }
 
-char neural_find_logic(struct neural_network *nn, const char path[static 1])
+char neural_find_logic(const struct neural_model *model,
+                       struct neural_workspace *ws, const char path[static 1])
 {
     uint_fast8_t input[INPUT_SIZE] = {0};
     path_to_bytes(path, input, 32, 32);
-    forward_pass(nn, input);
 
-    return (char)('a' + max_i(nn->output, countof(nn->output)));
+    return neural_find_input(model, ws, input);
 }
 
 /* Same thing here, we cannot replace this with a static inline. I'm sorry. */
@@ -170,8 +425,9 @@ char neural_find_logic(struct neural_network *nn, const char path[static 1])
             {                                                                  \
                 sum += (nlay_w)[j][i] * (nlay_d)[j];                           \
             }                                                                  \
-            (lay_d)[i] = hidden_delta((lay)[i]) * sum;                         \
+            (lay_d)[i] = sum;                                                  \
         }                                                                      \
+        line_dsigmoid_mul((lay_d), (lay), countof(lay));                       \
     } while (0)
 
 #define APPLY(lay_w, lay_d, lay_b, play)                                       \
@@ -187,99 +443,714 @@ char neural_find_logic(struct neural_network *nn, const char path[static 1])
         }                                                                      \
     } while (0)
 
-static void back_propagate(struct neural_network *nn,
-                           double expected[static OUTPUT_SIZE])
-{
-    double otp_delta[OUTPUT_SIZE] = {0};
-    double layer2_delta[LAYER2_SIZE] = {0};
-    double layer1_delta[LAYER1_SIZE] = {0};
+/* Same as APPLY, summing the gradient in grad_w and grad_b instead */
+#define ACCUMULATE(grad_w, lay_d, grad_b, play)                                \
+    do                                                                         \
+    {                                                                          \
+        for (size_t i = 0; i < countof(grad_w); ++i)                           \
+        {                                                                      \
+            for (size_t j = 0; j < countof(play); ++j)                         \
+            {                                                                  \
+                (grad_w)[i][j] += (lay_d)[i] * (play)[j];                      \
+            }                                                                  \
+            (grad_b)[i] += (lay_d)[i];                                         \
+        }                                                                      \
+    } while (0)
 
+/* Deltas of every layer for the sample in a workspace */
+struct deltas {
+    double output[OUTPUT_SIZE];
+    double layer2[LAYER2_SIZE];
+    double layer1[LAYER1_SIZE];
+};
+
+static void compute_deltas(const struct neural_params *params,
+                           const struct neural_workspace *ws,
+                           const double expected[static OUTPUT_SIZE],
+                           struct deltas *d)
+{
     // This one is a special case, so we don't put it in the macro.
     for (size_t i = 0; i < OUTPUT_SIZE; ++i)
     {
-        double otp = nn->output[i];
-        otp_delta[i] = (expected[i] - otp) * output_delta(otp);
+        d->output[i] = expected[i] - ws->output[i];
     }
+    line_dsigmoid_mul(d->output, ws->output, OUTPUT_SIZE);
 
-    PROPAG(nn->layer2, layer2_delta, otp_delta, nn->output_weights);
-    PROPAG(nn->layer1, layer1_delta, layer2_delta, nn->layer2_weights);
+    PROPAG(ws->layer2, d->layer2, d->output, params->output_weights);
+    PROPAG(ws->layer1, d->layer1, d->layer2, params->layer2_weights);
+}
 
-    APPLY(nn->output_weights, otp_delta, nn->output_biases, nn->layer2);
-    APPLY(nn->layer2_weights, layer2_delta, nn->layer2_biases, nn->layer1);
-    APPLY(nn->layer1_weights, layer1_delta, nn->layer1_biases, nn->input);
+static void back_propagate(struct neural_params *params,
+                           const struct neural_workspace *ws,
+                           const double expected[static OUTPUT_SIZE])
+{
+    struct deltas d = {0};
+    compute_deltas(params, ws, expected, &d);
+
+    APPLY(params->output_weights, d.output, params->output_biases, ws->layer2);
+    APPLY(params->layer2_weights, d.layer2, params->layer2_biases, ws->layer1);
+
+    // Inputs are 0 or 1 : the weights of the inputs left at 0 by the forward
+    // pass would only get zeros added, the others get the whole step
+    for (size_t i = 0; i < LAYER1_SIZE; ++i)
+    {
+        double step = LEARNING_RATE * d.layer1[i];
+        line_add_at(params->layer1_weights[i], ws->active, ws->n_active, step);
+        params->layer1_biases[i] += step;
+    }
 }
 
-static bool must_stop = false;
-void sigusr_handle(int _)
+/* Samples of an epoch, in the order it visits them */
+struct sampler {
+    size_t *order;
+    size_t count;
+};
+
+/* Samples an epoch over set visits : all of them once, or when balanced
+ * as many of every letter as the most common one has */
+static size_t epoch_size(const struct dataset *set, bool balanced)
 {
-    (void)_;
-    must_stop = true;
+    if (!balanced)
+    {
+        return set->count;
+    }
+    size_t largest = 0;
+    for (size_t c = 0; c < OUTPUT_SIZE; ++c)
+    {
+        size_t size = dataset_class_size(set, c);
+        largest = (size > largest) ? size : largest;
+    }
+    return largest * OUTPUT_SIZE;
 }
-void neural_train(struct neural_network *nn)
+
+/* sampler must then be freed with free_sampler */
+static bool sampler_alloc(size_t capacity, struct sampler *sampler)
 {
-    srandom((unsigned int)time(NULL));
-    randomize_layers(nn);
+    *sampler = (struct sampler){0};
+    sampler->order = calloc(capacity ? capacity : 1, sizeof(*sampler->order));
+    return sampler->order != NULL;
+}
 
-    (void)signal(SIGUSR1, sigusr_handle);
+static void free_sampler(struct sampler *sampler)
+{
+    free(sampler->order);
+    *sampler = (struct sampler){0};
+}
 
-    size_t best_correct = 0;
-    size_t hasnt_beaten_correct_count = 0;
+/* Draws the order of the next epoch over set : a permutation of every
+ * sample, so none is seen twice or missed. When balanced, every letter
+ * is topped up to the size of the most common one with random samples of
+ * its own, each sample still being seen at least once */
+static void sampler_fill(struct sampler *sampler, const struct dataset *set,
+                         bool balanced, struct rng *rng)
+{
+    size_t per_class = balanced ? epoch_size(set, true) / OUTPUT_SIZE : 0;
+    sampler->count = 0;
+    for (size_t c = 0; c < OUTPUT_SIZE; ++c)
+    {
+        size_t first = set->class_first[c];
+        size_t size = dataset_class_size(set, c);
+        for (size_t k = 0; k < size; ++k)
+        {
+            sampler->order[sampler->count++] = first + k;
+        }
+        for (size_t k = size; k < per_class && size > 0; ++k)
+        {
+            sampler->order[sampler->count++] = first + rng_below(rng, size);
+        }
+    }
+    shuffle(sampler->order, sampler->count, rng);
+}
 
-    for (int i = 0; i < EPOCHS && !must_stop; ++i)
+static void load_sample(const struct dataset *set, size_t sample,
+                        uint_fast8_t input[static INPUT_SIZE])
+{
+    const uint8_t *bytes = dataset_sample(set, sample);
+    for (size_t k = 0; k < INPUT_SIZE; ++k)
     {
-        printf("\nEntering Epoch %d: %d%% to the end\n", i, (100 * i) / EPOCHS);
-        size_t correct = 0;
+        input[k] = bytes[k];
+    }
+}
+
+/* Progress within an epoch of total samples, every percent */
+static void print_progress(int epoch, size_t done, size_t total)
+{
+#ifdef DEBUGPRINT
+    size_t step = (total >= 100) ? total / 100 : 1;
+    if (done + 1 == total || (done % step) == 0)
+    {
+        printf("\r\tEpoch %d: %zu%%", epoch, (100 * done) / total);
+        fflush(stdout);
+    }
+#else
+    (void)epoch;
+    (void)done;
+    (void)total;
+#endif
+}
+
+static double elapsed(const struct timespec *since)
+{
+    struct timespec now = {0};
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - since->tv_sec) +
+           ((double)(now.tv_nsec - since->tv_nsec) * 1e-9);
+}
+
+/* Batches of ready inputs, prepared by background threads while the
+ * trainer computes. Batch k of an epoch goes to slot k % LOADER_DEPTH and
+ * is prepared by producer k % n_producers, so batches come out in the
+ * sampler's order however many producers there are */
+enum { LOADER_DEPTH = 8, LOADER_BATCH = 64 };
+
+struct loader_slot {
+    // k while free for batch k, k + 1 once it holds it. Only read and
+    // written with __atomic, the inputs being handed over through it
+    size_t seq;
+    size_t count;
+    uint_fast8_t (*inputs)[INPUT_SIZE];
+    size_t *letters;
+};
+
+struct loader;
+struct loader_producer {
+    struct loader *loader;
+    size_t index;
+    thrd_t thread;
+};
+
+struct loader {
+    const struct dataset *set;
+    const struct sampler *sampler;
+    size_t batch_size;
+    size_t n_batches; // Of the epoch
+    struct loader_slot slots[LOADER_DEPTH];
+    struct loader_producer *producers;
+    size_t n_producers; // 0 : batches are prepared by the trainer itself
+    size_t next;        // Batch the trainer takes next
+
+    // Batches of the epoch the trainer had to wait for, and for how long
+    size_t stalls;
+    double stall_seconds;
+};
+
+static void free_loader(struct loader *loader)
+{
+    for (size_t i = 0; i < LOADER_DEPTH; ++i)
+    {
+        free(loader->slots[i].inputs);
+        free(loader->slots[i].letters);
+    }
+    free(loader->producers);
+    *loader = (struct loader){0};
+}
+
+/* Batches of batch_size samples, prepared by producers threads.
+ * loader must then be freed with free_loader */
+static bool loader_alloc(size_t batch_size, size_t producers,
+                         struct loader *loader)
+{
+    *loader = (struct loader){0};
+    loader->batch_size = batch_size;
+    loader->n_producers = producers;
+    bool ok = true;
+    for (size_t i = 0; i < LOADER_DEPTH; ++i)
+    {
+        struct loader_slot *slot = &loader->slots[i];
+        slot->inputs = calloc(batch_size, sizeof(*slot->inputs));
+        slot->letters = calloc(batch_size, sizeof(*slot->letters));
+        ok = ok && slot->inputs && slot->letters;
+    }
+    loader->producers = calloc(producers ? producers : 1,
+                               sizeof(*loader->producers));
+    if (!ok || !loader->producers)
+    {
+        free_loader(loader);
+        return false;
+    }
+    return true;
+}
 
-        const char *letter_path = "assets/letters";
-        if ((random() % 15) == 0)
+static void loader_fill(struct loader *loader, size_t k,
+                        struct loader_slot *slot)
+{
+    const struct sampler *sampler = loader->sampler;
+    size_t first = k * loader->batch_size;
+    size_t left = sampler->count - first;
+    slot->count = (left < loader->batch_size) ? left : loader->batch_size;
+    for (size_t j = 0; j < slot->count; ++j)
+    {
+        size_t sample = sampler->order[first + j];
+        slot->letters[j] = dataset_letter(loader->set, sample);
+        load_sample(loader->set, sample, slot->inputs[j]);
+    }
+}
+
+static int loader_produce(void *arg)
+{
+    struct loader_producer *producer = arg;
+    struct loader *loader = producer->loader;
+    for (size_t k = producer->index; k < loader->n_batches;
+         k += loader->n_producers)
+    {
+        struct loader_slot *slot = &loader->slots[k % LOADER_DEPTH];
+        // The ring is full, the trainer being slower : no need to spin
+        while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != k)
         {
-            letter_path = "assets/comparison";
-	    printf("Accursed generation!😱😱😱😱 \n");
+            (void)thrd_sleep(&(struct timespec){.tv_nsec = 50000}, NULL);
         }
+        loader_fill(loader, k, slot);
+        __atomic_store_n(&slot->seq, k + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* Starts preparing the epoch sampler lays out over set */
+static void loader_start(struct loader *loader, const struct dataset *set,
+                         const struct sampler *sampler)
+{
+    loader->set = set;
+    loader->sampler = sampler;
+    loader->n_batches =
+        (sampler->count + loader->batch_size - 1) / loader->batch_size;
+    loader->next = 0;
+    loader->stalls = 0;
+    loader->stall_seconds = 0;
+    for (size_t i = 0; i < LOADER_DEPTH; ++i)
+    {
+        loader->slots[i].seq = i;
+    }
 
-        for (int j = 0; j < DATASET_SIZE; ++j)
+    for (size_t p = 0; p < loader->n_producers; ++p)
+    {
+        struct loader_producer *producer = &loader->producers[p];
+        producer->loader = loader;
+        producer->index = p;
+        // Every producer owns its share of the batches, none can be missing
+        if (thrd_create(&producer->thread, loader_produce, producer) !=
+            thrd_success)
         {
-#ifdef DEBUGPRINT
-            if (j == DATASET_SIZE - 1 || (j % (DATASET_SIZE / 100)) == 0)
-            {
-                printf("\r\tEpoch %d: %d%%", i, (100 * j) / DATASET_SIZE);
-                fflush(stdout);
-            }
-#endif
-            size_t letter_idx = (size_t)(random() % 26);
-            char expected_letter = (char)('a' + letter_idx);
+            errx(1, "Could not start the loader threads");
+        }
+    }
+}
+
+/* Next batch of the epoch, NULL once it is over. It must be given back with
+ * loader_release before taking the next one */
+static const struct loader_slot *loader_next(struct loader *loader)
+{
+    if (loader->next == loader->n_batches)
+    {
+        return NULL;
+    }
+    struct loader_slot *slot = &loader->slots[loader->next % LOADER_DEPTH];
+    if (loader->n_producers == 0)
+    {
+        loader_fill(loader, loader->next, slot);
+        return slot;
+    }
+
+    size_t ready = loader->next + 1;
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ready)
+    {
+        struct timespec start = {0};
+        (void)clock_gettime(CLOCK_MONOTONIC, &start);
+        while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ready)
+        {
+            thrd_yield();
+        }
+        loader->stalls++;
+        loader->stall_seconds += elapsed(&start);
+    }
+    return slot;
+}
+
+static void loader_release(struct loader *loader)
+{
+    struct loader_slot *slot = &loader->slots[loader->next % LOADER_DEPTH];
+    __atomic_store_n(&slot->seq, loader->next + LOADER_DEPTH,
+                     __ATOMIC_RELEASE);
+    loader->next++;
+}
+
+/* Waits for the producers, once every batch has been taken */
+static void loader_finish(struct loader *loader)
+{
+    for (size_t p = 0; p < loader->n_producers; ++p)
+    {
+        (void)thrd_join(loader->producers[p].thread, NULL);
+    }
+}
 
-            char path[128] = {0};
-            assert(snprintf(path, sizeof(path), "%s/%c/%ld.bmp", letter_path,
-                            expected_letter,
-                            random() % DATASET_PER_INPUT) < (long)sizeof(path));
+/* Takes a step on input, of the letter_idx-th letter. Returns whether it
+ * was recognized before the step */
+static bool train_step(struct neural_params *params,
+                       struct neural_workspace *ws,
+                       const uint_fast8_t input[static INPUT_SIZE],
+                       size_t letter_idx)
+{
+    double expected[OUTPUT_SIZE] = {0};
+    expected[letter_idx] = 1;
 
-            uint_fast8_t input[INPUT_SIZE];
-            if (!path_to_bytes(path, input, 32, 32))
+    forward_pass(params, ws, input);
+    back_propagate(params, ws, expected);
+    return max_i(ws->output, countof(ws->output)) == letter_idx;
+}
+
+/* One epoch of plain SGD, a step after every sample. Returns how many
+ * samples were recognized */
+static size_t train_online(struct neural_network *nn, struct loader *loader,
+                           int epoch)
+{
+    size_t correct = 0;
+    size_t done = 0;
+    const struct loader_slot *batch = NULL;
+    while ((batch = loader_next(loader)))
+    {
+        for (size_t j = 0; j < batch->count; ++j, ++done)
+        {
+            print_progress(epoch, done, loader->sampler->count);
+            if (train_step(&nn->params, &nn->ws, batch->inputs[j],
+                           batch->letters[j]))
             {
-                continue;
+                correct += 1;
             }
+        }
+        loader_release(loader);
+    }
+    return correct;
+}
+
+/* Hogwild : every thread takes steps on its own samples straight into the
+ * shared params, without any lock. A step only changes the layer1 weights of
+ * the ink pixels of its sample, so threads seldom write the same weights,
+ * and an update lost when they do is no worse than noise in the gradient */
+struct hogwild_trainer {
+    struct neural_params *params;
+    const struct dataset *set;
+    const struct sampler *sampler; // Split evenly between the threads
+    struct thread_pool pool;
+    size_t *correct; // One per thread, over the epoch
+};
+
+static void free_hogwild_trainer(struct hogwild_trainer *tr)
+{
+    free_thread_pool(&tr->pool);
+    free(tr->correct);
+    *tr = (struct hogwild_trainer){0};
+}
+
+static bool hogwild_trainer_alloc(struct neural_network *nn, size_t threads,
+                                  struct hogwild_trainer *tr)
+{
+    *tr = (struct hogwild_trainer){0};
+    tr->params = &nn->params;
+    if (!thread_pool_alloc(threads, &tr->pool))
+    {
+        return false;
+    }
+    tr->correct = calloc(tr->pool.threads, sizeof(*tr->correct));
+    if (!tr->correct)
+    {
+        free_hogwild_trainer(tr);
+        return false;
+    }
+    return true;
+}
 
-            double expected[OUTPUT_SIZE] = {0};
-            expected[letter_idx] = 1;
+static void hogwild_steps(void *arg, size_t task)
+{
+    struct hogwild_trainer *tr = arg;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range(tr->sampler->count, tr->pool.threads, task, &begin, &end);
 
-            forward_pass(nn, input);
-            back_propagate(nn, expected);
+    // Kept local, the counts of every thread sharing cache lines
+    struct neural_workspace ws = {0};
+    size_t correct = 0;
+    for (size_t j = begin; j < end; ++j)
+    {
+        // Every core already computes, the samples are prepared inline
+        size_t sample = tr->sampler->order[j];
+        uint_fast8_t input[INPUT_SIZE] = {0};
+        load_sample(tr->set, sample, input);
+        if (train_step(tr->params, &ws, input, dataset_letter(tr->set, sample)))
+        {
+            correct++;
+        }
+    }
+    tr->correct[task] += correct;
+}
 
-            size_t obtained = max_i(nn->output, countof(nn->output));
-            if (obtained == letter_idx)
+/* One epoch of Hogwild training. Returns how many samples were recognized */
+static size_t train_hogwild(struct hogwild_trainer *tr,
+                            const struct dataset *set,
+                            const struct sampler *sampler)
+{
+    tr->set = set;
+    tr->sampler = sampler;
+    thread_pool_run(&tr->pool, hogwild_steps, tr, tr->pool.threads);
+
+    size_t correct = 0;
+    for (size_t t = 0; t < tr->pool.threads; ++t)
+    {
+        correct += tr->correct[t];
+        tr->correct[t] = 0;
+    }
+    return correct;
+}
+
+/* Mini-batch training : the samples of a batch are split between the
+ * threads, each summing its gradients in its own buffer, and the buffers
+ * are then averaged into a single step, as large as that of a single
+ * sample whatever the size of the batch */
+struct batch_trainer {
+    struct neural_network *nn;
+    struct thread_pool pool;
+    struct neural_params *grads; // One per thread
+    size_t *correct;             // One per thread, over the epoch
+    const struct loader_slot *batch;
+    size_t n_grads; // Tasks computing gradients, each with its buffer
+};
+
+static void free_batch_trainer(struct batch_trainer *tr)
+{
+    free_thread_pool(&tr->pool);
+    free(tr->grads);
+    free(tr->correct);
+    *tr = (struct batch_trainer){0};
+}
+
+static bool batch_trainer_alloc(struct neural_network *nn, size_t threads,
+                                struct batch_trainer *tr)
+{
+    *tr = (struct batch_trainer){0};
+    tr->nn = nn;
+    if (!thread_pool_alloc(threads, &tr->pool))
+    {
+        return false;
+    }
+
+    void *grads = NULL;
+    size_t n = tr->pool.threads;
+    if (posix_memalign(&grads, 64, n * sizeof(*tr->grads)) == 0)
+    {
+        tr->grads = grads;
+        memset(tr->grads, 0, n * sizeof(*tr->grads));
+    }
+    tr->correct = calloc(n, sizeof(*tr->correct));
+    if (!tr->grads || !tr->correct)
+    {
+        free_batch_trainer(tr);
+        return false;
+    }
+    return true;
+}
+
+static void batch_gradients(void *arg, size_t task)
+{
+    struct batch_trainer *tr = arg;
+    const struct neural_params *params = &tr->nn->params;
+    struct neural_params *grad = &tr->grads[task];
+    size_t begin = 0;
+    size_t end = 0;
+    task_range(tr->batch->count, tr->n_grads, task, &begin, &end);
+
+    struct neural_workspace ws = {0};
+    size_t correct = 0;
+    for (size_t k = begin; k < end; ++k)
+    {
+        size_t letter_idx = tr->batch->letters[k];
+        double expected[OUTPUT_SIZE] = {0};
+        expected[letter_idx] = 1;
+
+        forward_pass(params, &ws, tr->batch->inputs[k]);
+        struct deltas d = {0};
+        compute_deltas(params, &ws, expected, &d);
+
+        ACCUMULATE(grad->output_weights, d.output, grad->output_biases,
+                   ws.layer2);
+        ACCUMULATE(grad->layer2_weights, d.layer2, grad->layer2_biases,
+                   ws.layer1);
+        for (size_t i = 0; i < LAYER1_SIZE; ++i)
+        {
+            line_add_at(grad->layer1_weights[i], ws.active, ws.n_active,
+                        d.layer1[i]);
+            grad->layer1_biases[i] += d.layer1[i];
+        }
+
+        if (max_i(ws.output, OUTPUT_SIZE) == letter_idx)
+        {
+            correct++;
+        }
+    }
+    tr->correct[task] += correct;
+}
+
+/* Params summed at once by batch_step, small enough to stay in L1 */
+enum { STEP_BLOCK = 512 };
+
+/* Adds the mean of the gradients of every buffer to the params and clears
+ * them, each task taking a slice of the params. Both are seen as flat arrays
+ * of doubles : the padding between the arrays only ever gets zeros added */
+static void batch_step(void *arg, size_t task)
+{
+    struct batch_trainer *tr = arg;
+    const size_t n = sizeof(struct neural_params) / sizeof(double);
+    double *params = (double *)&tr->nn->params;
+    // The mean gradient, so that the batch size doesn't scale the rate
+    double rate = LEARNING_RATE / (double)tr->batch->count;
+    size_t begin = 0;
+    size_t end = 0;
+    task_range(n, tr->pool.threads, task, &begin, &end);
+
+    for (size_t p0 = begin; p0 < end; p0 += STEP_BLOCK)
+    {
+        size_t pn = (end - p0 < STEP_BLOCK) ? end - p0 : STEP_BLOCK;
+        double sum[STEP_BLOCK] = {0};
+        for (size_t t = 0; t < tr->n_grads; ++t)
+        {
+            double *grad = (double *)&tr->grads[t] + p0;
+            for (size_t q = 0; q < pn; ++q)
             {
-                correct += 1;
+                sum[q] += grad[q];
             }
+            memset(grad, 0, pn * sizeof(*grad));
+        }
+        for (size_t q = 0; q < pn; ++q)
+        {
+            params[p0 + q] += rate * sum[q];
+        }
+    }
+}
+
+/* One epoch of mini-batch training, a step per batch of the loader.
+ * Returns how many samples were recognized */
+static size_t train_batches(struct batch_trainer *tr, struct loader *loader,
+                            int epoch)
+{
+    size_t done = 0;
+    while ((tr->batch = loader_next(loader)))
+    {
+        print_progress(epoch, done, loader->sampler->count);
+        done += tr->batch->count;
+
+        tr->n_grads = thread_pool_tasks(&tr->pool, tr->batch->count, 1);
+        thread_pool_run(&tr->pool, batch_gradients, tr, tr->n_grads);
+        thread_pool_run(&tr->pool, batch_step, tr, tr->pool.threads);
+        loader_release(loader);
+    }
+
+    size_t correct = 0;
+    for (size_t t = 0; t < tr->pool.threads; ++t)
+    {
+        correct += tr->correct[t];
+        tr->correct[t] = 0;
+    }
+    return correct;
+}
+
+static bool must_stop = false;
+void sigusr_handle(int _)
+{
+    (void)_;
+    must_stop = true;
+}
+void neural_train(struct neural_network *nn,
+                  const struct train_config *config)
+{
+    uint64_t seed = config->seed ? config->seed : (uint64_t)time(NULL);
+    printf("Seed: %" PRIu64 "\n", seed);
+    struct rng rng = {0};
+    rng_seed(&rng, seed);
+    randomize_layers(nn, &rng);
+
+    (void)signal(SIGUSR1, sigusr_handle);
+
+    struct batch_trainer trainer = {0};
+    struct hogwild_trainer hogwild = {0};
+    struct loader loader = {0};
+    bool batched = !config->hogwild && config->batch_size > 1;
+    if (batched && !batch_trainer_alloc(nn, config->threads, &trainer))
+    {
+        errx(1, "Could not start the mini-batch training threads");
+    }
+    if (!config->hogwild &&
+        !loader_alloc(batched ? config->batch_size : LOADER_BATCH,
+                      config->loaders, &loader))
+    {
+        errx(1, "Could not allocate the loader");
+    }
+    if (config->hogwild &&
+        !hogwild_trainer_alloc(nn, config->threads, &hogwild))
+    {
+        errx(1, "Could not start the Hogwild training threads");
+    }
+
+    // One buffer for the order of both sets
+    size_t capacity = epoch_size(config->letters, config->balanced);
+    if (config->comparison &&
+        epoch_size(config->comparison, config->balanced) > capacity)
+    {
+        capacity = epoch_size(config->comparison, config->balanced);
+    }
+    struct sampler sampler = {0};
+    if (!sampler_alloc(capacity, &sampler))
+    {
+        errx(1, "Could not allocate the order of the samples");
+    }
+
+    int epochs = config->epochs ? (int)config->epochs : EPOCHS;
+    double best_accuracy = 0;
+    size_t hasnt_beaten_correct_count = 0;
+
+    for (int i = 0; i < epochs && !must_stop; ++i)
+    {
+        printf("\nEntering Epoch %d: %d%% to the end\n", i, (100 * i) / epochs);
+
+        const struct dataset *set = config->letters;
+        if (rng_below(&rng, 15) == 0 && config->comparison)
+        {
+            set = config->comparison;
+	    printf("Accursed generation!😱😱😱😱 \n");
+        }
+
+        if (set == config->letters && config->renew)
+        {
+            config->renew(config->renew_ctx, &rng);
+        }
+        sampler_fill(&sampler, set, config->balanced, &rng);
+        struct timespec start = {0};
+        (void)clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t correct = 0;
+        if (config->hogwild)
+        {
+            correct = train_hogwild(&hogwild, set, &sampler);
+        }
+        else
+        {
+            loader_start(&loader, set, &sampler);
+            correct = batched ? train_batches(&trainer, &loader, i)
+                              : train_online(nn, &loader, i);
+            loader_finish(&loader);
+        }
+        double seconds = elapsed(&start);
+        double accuracy =
+            sampler.count ? (double)correct / (double)sampler.count : 0;
+        printf("\nEpoch %d: accuracy of %.1f%% over %zu samples, %.0f "
+               "samples/s\n",
+               i, 100.0 * accuracy, sampler.count,
+               (double)sampler.count / seconds);
+        if (loader.n_producers > 0)
+        {
+            printf("Waited for samples before %zu of %zu batches, %.3fs\n",
+                   loader.stalls, loader.n_batches, loader.stall_seconds);
         }
-#ifdef DEBUGPRINT
-        printf("\nEpoch %d: accuracy of %.1f%%\n", i,
-               (100.0 * (double)correct) / (double)DATASET_SIZE);
-#endif
 
-        if (correct > best_correct)
+        // Accuracies, as epochs over the comparison set are of another size
+        if (accuracy > best_accuracy)
         {
-            best_correct = correct;
+            best_accuracy = accuracy;
             hasnt_beaten_correct_count = 0;
             continue;
         }
@@ -289,4 +1160,8 @@ void neural_train(struct neural_network *nn)
             break; //  Early stopping
         }
     }
+    free_sampler(&sampler);
+    free_loader(&loader);
+    free_batch_trainer(&trainer);
+    free_hogwild_trainer(&hogwild);
 }
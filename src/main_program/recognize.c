@@ -0,0 +1,44 @@
+#include <recognize.h>
+#include <thread_pool.h>
+
+/* Cells per task. Tasks are taken one at a time from the pool, small ones
+ * keep the threads even when some cells cost more than others */
+enum { CELLS_PER_TASK = 4 };
+
+struct recognize_job {
+    const struct neural_model *model;
+    const struct grid_cells *grid;
+    char *letters;
+    size_t n_cells;
+};
+
+static void recognize_cells(void *arg, size_t task)
+{
+    struct recognize_job *job = arg;
+    size_t begin = task * CELLS_PER_TASK;
+    size_t end = (begin + CELLS_PER_TASK < job->n_cells)
+                     ? begin + CELLS_PER_TASK
+                     : job->n_cells;
+
+    struct neural_workspace ws = {0};
+    for (size_t k = begin; k < end; ++k)
+    {
+        const struct cell_image *cell = &job->grid->cells[k];
+        uint_fast8_t input[INPUT_SIZE] = {0};
+        if (cell->pixels)
+        {
+            (void)resize_to_bytes(cell->pixels, (size_t)cell->w, cell->w,
+                                  cell->h, input, 32, 32);
+        }
+        job->letters[k] = neural_find_input(job->model, &ws, input);
+    }
+}
+
+void recognize_grid(const struct neural_model *model,
+                    const struct grid_cells *grid, char letters[])
+{
+    struct recognize_job job = {model, grid, letters,
+                                (size_t)grid->rows * (size_t)grid->cols};
+    size_t n_tasks = (job.n_cells + CELLS_PER_TASK - 1) / CELLS_PER_TASK;
+    thread_pool_run(thread_pool_default(), recognize_cells, &job, n_tasks);
+}
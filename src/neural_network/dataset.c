@@ -0,0 +1,146 @@
+#include "grayscale.h"
+#include <dataset.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool dataset_pack(const char dir[static 1], const char path[static 1])
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+
+    // The header is only known at the end, the samples go after its room
+    struct dataset_header header = {DATASET_MAGIC, DATASET_VERSION, INPUT_SIZE,
+                                    OUTPUT_SIZE, 0, 0, {0}};
+    header.samples_offset = (uint32_t)(((sizeof(header) + DATASET_ALIGN - 1) /
+                                        DATASET_ALIGN) * DATASET_ALIGN);
+    bool ok = fseek(file, header.samples_offset, SEEK_SET) == 0;
+
+    size_t missing = 0;
+    for (size_t c = 0; c < OUTPUT_SIZE && ok; ++c)
+    {
+        header.class_first[c] = header.count;
+        for (size_t n = 0; n < DATASET_PER_INPUT && ok; ++n)
+        {
+            char sample_path[4096] = {0};
+            (void)snprintf(sample_path, sizeof(sample_path), "%s/%c/%zu.bmp",
+                           dir, (char)('a' + c), n);
+
+            uint_fast8_t input[INPUT_SIZE] = {0};
+            if (!path_to_bytes(sample_path, input, 32, 32))
+            {
+                missing++;
+                continue;
+            }
+            uint8_t bytes[INPUT_SIZE] = {0};
+            for (size_t i = 0; i < INPUT_SIZE; ++i)
+            {
+                bytes[i] = input[i] ? 1 : 0;
+            }
+            ok = fwrite(bytes, sizeof(bytes), 1, file) == 1;
+            header.count++;
+        }
+        printf("\r%c: %u samples", (char)('a' + c),
+               header.count - header.class_first[c]);
+        (void)fflush(stdout);
+    }
+    header.class_first[OUTPUT_SIZE] = header.count;
+    printf("\n%u samples packed, %zu missing\n", header.count, missing);
+
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+         fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fclose(file) != 0 || !ok)
+    {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+/* Whether the mapping of size bytes is a dataset that fits this network */
+static bool header_is_valid(const struct dataset_header *header, size_t size)
+{
+    if (size < sizeof(*header) ||
+        memcmp(header->magic, DATASET_MAGIC, sizeof(DATASET_MAGIC)) != 0 ||
+        header->version != DATASET_VERSION ||
+        header->sample_size != INPUT_SIZE || header->classes != OUTPUT_SIZE ||
+        header->samples_offset % DATASET_ALIGN != 0 ||
+        header->samples_offset < sizeof(*header) ||
+        header->samples_offset > size)
+    {
+        return false;
+    }
+    if (header->class_first[0] != 0 ||
+        header->class_first[OUTPUT_SIZE] != header->count)
+    {
+        return false;
+    }
+    for (size_t c = 0; c < OUTPUT_SIZE; ++c)
+    {
+        if (header->class_first[c] > header->class_first[c + 1])
+        {
+            return false;
+        }
+    }
+    return (size - header->samples_offset) / INPUT_SIZE >= header->count;
+}
+
+bool dataset_load_alloc(const char path[static 1], struct dataset *set)
+{
+    *set = (struct dataset){0};
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    struct stat st = {0};
+    if (fstat(fd, &st) == -1 ||
+        (size_t)st.st_size < sizeof(struct dataset_header))
+    {
+        (void)close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+
+    const struct dataset_header *header = map;
+    if (!header_is_valid(header, size))
+    {
+        (void)munmap(map, size);
+        return false;
+    }
+    // Training picks samples all over the file, better to read it in at once
+    (void)madvise(map, size, MADV_WILLNEED);
+
+    set->count = header->count;
+    for (size_t c = 0; c <= OUTPUT_SIZE; ++c)
+    {
+        set->class_first[c] = header->class_first[c];
+    }
+    set->samples = (const uint8_t *)map + header->samples_offset;
+    set->map = map;
+    set->map_size = size;
+    return true;
+}
+
+void free_dataset(struct dataset *set)
+{
+    if (set->map)
+    {
+        (void)munmap(set->map, set->map_size);
+    }
+    *set = (struct dataset){0};
+}
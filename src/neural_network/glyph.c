@@ -0,0 +1,312 @@
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include <err.h>
+#include <glyph.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread_pool.h>
+
+/* Letters are rendered well above GLYPH_SIZE, then shrunk so that the
+ * larger side of their bounding box spans GLYPH_BOX */
+enum { GLYPH_POINTS = 96, GLYPH_BOX = 56 };
+
+/* Side of a sample, INPUT_SIZE being its square */
+enum { SAMPLE_SIDE = 32 };
+
+/* Ranges the samples are drawn from. At a scale of 1, the larger side of a
+ * letter spans LETTER_SPAN pixels of the SAMPLE_SIDE */
+#define LETTER_SPAN 22.0
+#define SCALE_MIN 0.8
+#define SCALE_MAX 1.1
+#define MAX_SHIFT 2.5    // Pixels, both ways
+#define MAX_ROTATION 8.0 // Degrees, both ways
+#define THRESHOLD_MIN 0.25 // Of the coverage, a lower one draws bolder
+#define THRESHOLD_MAX 0.65
+#define BOLD_RATE 0.2 // Samples grown by a pixel all around
+#define THIN_RATE 0.1 // Samples eroded by a pixel, when some ink is left
+#define MAX_NOISE 0.02 // Rate of the pixels flipped
+
+/* Bilinear value of the w x h plane at (x, y), 0 outside */
+static double plane_at(const uint8_t *plane, int w, int h, double x, double y)
+{
+    int x0 = (int)floor(x);
+    int y0 = (int)floor(y);
+    double fx = x - x0;
+    double fy = y - y0;
+    double sum = 0;
+    for (int dy = 0; dy <= 1; ++dy)
+    {
+        for (int dx = 0; dx <= 1; ++dx)
+        {
+            int px = x0 + dx;
+            int py = y0 + dy;
+            if (px < 0 || py < 0 || px >= w || py >= h)
+            {
+                continue;
+            }
+            double weight = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy);
+            sum += weight * plane[((size_t)py * (size_t)w) + (size_t)px];
+        }
+    }
+    return sum;
+}
+
+/* Fits the ink of a rendered glyph (alpha being the coverage) into mask.
+ * Returns false if it has none */
+static bool fit_mask(SDL_Surface *glyph,
+                     uint8_t mask[static GLYPH_SIZE * GLYPH_SIZE])
+{
+    SDL_Surface *argb =
+        SDL_ConvertSurfaceFormat(glyph, SDL_PIXELFORMAT_ARGB8888, 0);
+    if (!argb)
+    {
+        return false;
+    }
+    int w = argb->w;
+    int h = argb->h;
+    uint8_t *alpha = calloc((size_t)w * (size_t)h, 1);
+    if (!alpha)
+    {
+        SDL_FreeSurface(argb);
+        return false;
+    }
+
+    int x0 = w;
+    int y0 = h;
+    int x1 = -1;
+    int y1 = -1;
+    for (int y = 0; y < h; ++y)
+    {
+        const uint32_t *row =
+            (const uint32_t *)((const uint8_t *)argb->pixels +
+                               ((size_t)y * (size_t)argb->pitch));
+        for (int x = 0; x < w; ++x)
+        {
+            uint8_t a = (uint8_t)(row[x] >> 24);
+            alpha[((size_t)y * (size_t)w) + (size_t)x] = a;
+            if (a)
+            {
+                x0 = (x < x0) ? x : x0;
+                y0 = (y < y0) ? y : y0;
+                x1 = (x > x1) ? x : x1;
+                y1 = (y > y1) ? y : y1;
+            }
+        }
+    }
+    SDL_FreeSurface(argb);
+    if (x1 < 0)
+    {
+        free(alpha);
+        return false;
+    }
+
+    int side = (x1 - x0 > y1 - y0) ? x1 - x0 + 1 : y1 - y0 + 1;
+    double k = (double)GLYPH_BOX / side; // Mask pixels per glyph pixel
+    double cx = (x0 + x1 + 1) / 2.0;
+    double cy = (y0 + y1 + 1) / 2.0;
+    for (int j = 0; j < GLYPH_SIZE; ++j)
+    {
+        for (int i = 0; i < GLYPH_SIZE; ++i)
+        {
+            double sx = ((i + 0.5 - (GLYPH_SIZE / 2.0)) / k) + cx;
+            double sy = ((j + 0.5 - (GLYPH_SIZE / 2.0)) / k) + cy;
+            double a = plane_at(alpha, w, h, sx - 0.5, sy - 0.5);
+            mask[(j * GLYPH_SIZE) + i] = (uint8_t)lrint(a);
+        }
+    }
+    free(alpha);
+    return true;
+}
+
+bool glyph_set_load(const char path[static 1], struct glyph_set *glyphs)
+{
+    bool was_init = TTF_WasInit() > 0;
+    if (!was_init && TTF_Init() != 0)
+    {
+        warnx("TTF_Init: %s", TTF_GetError());
+        return false;
+    }
+    TTF_Font *font = TTF_OpenFont(path, GLYPH_POINTS);
+    if (!font)
+    {
+        warnx("TTF_OpenFont: %s", TTF_GetError());
+        if (!was_init)
+        {
+            TTF_Quit();
+        }
+        return false;
+    }
+
+    bool ok = true;
+    const SDL_Color ink = {0, 0, 0, 255};
+    for (size_t c = 0; c < OUTPUT_SIZE && ok; ++c)
+    {
+        uint16_t letter = (uint16_t)('A' + c);
+        SDL_Surface *glyph = TTF_GlyphIsProvided(font, letter)
+                                 ? TTF_RenderGlyph_Blended(font, letter, ink)
+                                 : NULL;
+        ok = glyph && fit_mask(glyph, glyphs->masks[c]);
+        if (!ok)
+        {
+            warnx("%s: could not render %c", path, (char)letter);
+        }
+        if (glyph)
+        {
+            SDL_FreeSurface(glyph);
+        }
+    }
+
+    TTF_CloseFont(font);
+    if (!was_init)
+    {
+        TTF_Quit();
+    }
+    return ok;
+}
+
+static double uniform(struct rng *rng, double min, double max)
+{
+    return min + ((max - min) * rng_double(rng));
+}
+
+/* Ink grown (or shrunk when !grow) by a pixel in the 4 directions */
+static void morph(uint8_t sample[static INPUT_SIZE], bool grow)
+{
+    uint8_t copy[INPUT_SIZE] = {0};
+    memcpy(copy, sample, sizeof(copy));
+    for (int y = 0; y < SAMPLE_SIDE; ++y)
+    {
+        for (int x = 0; x < SAMPLE_SIDE; ++x)
+        {
+            // Out of the sample is paper
+            bool l = x > 0 && copy[(y * SAMPLE_SIDE) + x - 1];
+            bool r = x + 1 < SAMPLE_SIDE && copy[(y * SAMPLE_SIDE) + x + 1];
+            bool u = y > 0 && copy[((y - 1) * SAMPLE_SIDE) + x];
+            bool d = y + 1 < SAMPLE_SIDE && copy[((y + 1) * SAMPLE_SIDE) + x];
+            bool self = copy[(y * SAMPLE_SIDE) + x];
+            sample[(y * SAMPLE_SIDE) + x] =
+                grow ? (self || l || r || u || d) : (self && l && r && u && d);
+        }
+    }
+}
+
+static size_t ink_count(const uint8_t sample[static INPUT_SIZE])
+{
+    size_t ink = 0;
+    for (size_t i = 0; i < INPUT_SIZE; ++i)
+    {
+        ink += sample[i];
+    }
+    return ink;
+}
+
+void glyph_render(const struct glyph_set *glyphs, size_t c, struct rng *rng,
+                  uint8_t sample[static INPUT_SIZE])
+{
+    double scale = uniform(rng, SCALE_MIN, SCALE_MAX);
+    double angle = uniform(rng, -MAX_ROTATION, MAX_ROTATION) * M_PI / 180;
+    double shift_x = uniform(rng, -MAX_SHIFT, MAX_SHIFT);
+    double shift_y = uniform(rng, -MAX_SHIFT, MAX_SHIFT);
+    double threshold = 255 * uniform(rng, THRESHOLD_MIN, THRESHOLD_MAX);
+    double noise = uniform(rng, 0, MAX_NOISE);
+
+    // Every sample pixel is mapped back into the mask : mask pixels per
+    // sample pixel, turned the other way
+    double f = GLYPH_BOX / (LETTER_SPAN * scale);
+    double cos_f = cos(angle) * f;
+    double sin_f = sin(angle) * f;
+    const uint8_t *mask = glyphs->masks[c];
+    for (int y = 0; y < SAMPLE_SIDE; ++y)
+    {
+        for (int x = 0; x < SAMPLE_SIDE; ++x)
+        {
+            double dx = x + 0.5 - (SAMPLE_SIDE / 2.0) - shift_x;
+            double dy = y + 0.5 - (SAMPLE_SIDE / 2.0) - shift_y;
+            double u = (cos_f * dx) + (sin_f * dy) + (GLYPH_SIZE / 2.0);
+            double v = (cos_f * dy) - (sin_f * dx) + (GLYPH_SIZE / 2.0);
+            double a = plane_at(mask, GLYPH_SIZE, GLYPH_SIZE, u - 0.5, v - 0.5);
+            sample[(y * SAMPLE_SIDE) + x] = a > threshold;
+        }
+    }
+
+    double stroke = rng_double(rng);
+    if (stroke < BOLD_RATE)
+    {
+        morph(sample, true);
+    }
+    else if (stroke < BOLD_RATE + THIN_RATE)
+    {
+        uint8_t thin[INPUT_SIZE] = {0};
+        memcpy(thin, sample, sizeof(thin));
+        morph(thin, false);
+        // Thin strokes would vanish, those letters keep theirs
+        if (2 * ink_count(thin) >= ink_count(sample))
+        {
+            memcpy(sample, thin, sizeof(thin));
+        }
+    }
+
+    for (size_t i = 0; i < INPUT_SIZE; ++i)
+    {
+        if (rng_double(rng) < noise)
+        {
+            sample[i] ^= 1;
+        }
+    }
+}
+
+bool glyph_source_alloc(const struct glyph_set *glyphs, size_t per_letter,
+                        struct glyph_source *source)
+{
+    *source = (struct glyph_source){0};
+    size_t count = per_letter * OUTPUT_SIZE;
+    source->buffer = calloc(count ? count : 1, INPUT_SIZE);
+    if (!source->buffer)
+    {
+        return false;
+    }
+    source->glyphs = glyphs;
+    source->set.count = count;
+    for (size_t c = 0; c <= OUTPUT_SIZE; ++c)
+    {
+        source->set.class_first[c] = c * per_letter;
+    }
+    source->set.samples = source->buffer;
+    return true;
+}
+
+void free_glyph_source(struct glyph_source *source)
+{
+    free(source->buffer);
+    *source = (struct glyph_source){0};
+}
+
+struct renew_job {
+    struct glyph_source *source;
+    uint64_t seeds[OUTPUT_SIZE]; // Of every letter, whatever thread draws it
+};
+
+static void renew_letter(void *arg, size_t c)
+{
+    struct renew_job *job = arg;
+    struct glyph_source *source = job->source;
+    struct rng rng = {0};
+    rng_seed(&rng, job->seeds[c]);
+    for (size_t k = source->set.class_first[c];
+         k < source->set.class_first[c + 1]; ++k)
+    {
+        glyph_render(source->glyphs, c, &rng,
+                     source->buffer + (k * INPUT_SIZE));
+    }
+}
+
+void glyph_source_renew(void *source, struct rng *rng)
+{
+    struct renew_job job = {source, {0}};
+    for (size_t c = 0; c < OUTPUT_SIZE; ++c)
+    {
+        job.seeds[c] = rng_next(rng);
+    }
+    thread_pool_run(thread_pool_default(), renew_letter, &job, OUTPUT_SIZE);
+}
@@ -1,25 +1,238 @@
 #include "grayscale.h"
+#include <dataset.h>
 #include <err.h>
+#include <getopt.h>
+#include <glyph.h>
 #include <neural.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+/* Packs written by p, the comparison one is optional */
+#define LETTERS_PACK "assets/letters.pack"
+#define COMPARISON_PACK "assets/comparison.pack"
 
 static void print_usage(void)
 {
     printf("Neural: Finds the solution to an XNOR expression through a neural "
            "network\n"
 
-           "Usage: neural t|(l <file>)\n"
-           "\tt: Train network and save it to weights.bin\n"
-           "\tl: Load saved network from weights.bin\n");
+           "Usage: neural (t|c [<options>])|(f <font> [<options>])|"
+           "(l <file>)|(p <dir> <pack>)\n"
+           "\tt: Train network on " LETTERS_PACK " and save it to "
+           "weights.bin\n"
+           "\tf: Same as t, on letters rendered from the TTF <font> (e.g. "
+           "assets/font.ttf) anew every epoch, without any image file\n"
+           "\tc: Compare online, mini-batch and Hogwild training over a few "
+           "epochs each\n"
+           "\t\t--batch=<n>: Samples per step, computed in parallel, "
+           "the step following their mean gradient (default 1)\n"
+           "\t\t--hogwild: Threads step on their own samples at once, "
+           "without locks\n"
+           "\t\t--threads=<n>: Threads of mini-batch or Hogwild training "
+           "(default one per core)\n"
+           "\t\t--epochs=<n>: Epochs at most (default %d, 3 for c)\n"
+           "\t\t--loaders=<n>: Threads preparing samples ahead (default "
+           "1, 0 for none)\n"
+           "\t\t--balanced: Every letter seen as often in an epoch\n"
+           "\t\t--seed=<n>: Replays the run printing this seed (default "
+           "from the clock)\n"
+           "\tl: Load saved network from weights.bin\n"
+           "\tp: Pack the letter tree <dir>/<c>/<n>.bmp into <pack>\n",
+           EPOCHS);
+}
+
+static const struct option TRAIN_OPTIONS[] = {
+    {"batch", required_argument, NULL, 'b'},
+    {"threads", required_argument, NULL, 'j'},
+    {"hogwild", no_argument, NULL, 'w'},
+    {"balanced", no_argument, NULL, 'a'},
+    {"loaders", required_argument, NULL, 'l'},
+    {"epochs", required_argument, NULL, 'e'},
+    {"seed", required_argument, NULL, 's'},
+    {NULL, 0, NULL, 0},
+};
+
+/* Reads the options of t into config, argv[0] being "t" */
+static bool parse_train_options(int argc, char *argv[],
+                                struct train_config *config)
+{
+    int opt = 0;
+    const char *shorts = "b:j:wal:e:s:";
+    while ((opt = getopt_long(argc, argv, shorts, TRAIN_OPTIONS, NULL)) != -1)
+    {
+        if (opt == 'w')
+        {
+            config->hogwild = true;
+            continue;
+        }
+        if (opt == 'a')
+        {
+            config->balanced = true;
+            continue;
+        }
+        char *end = NULL;
+        unsigned long long value = strtoull(optarg ? optarg : "", &end, 10);
+        if (opt == '?' || !optarg || *optarg == '\0' || *end != '\0')
+        {
+            return false;
+        }
+        switch (opt)
+        {
+        case 'e':
+            config->epochs = (size_t)value;
+            break;
+        case 'l':
+            config->loaders = (size_t)value;
+            break;
+        case 's':
+            config->seed = (uint64_t)value;
+            break;
+        case 'b':
+            config->batch_size = (size_t)value;
+            break;
+        case 'j':
+            config->threads = (size_t)value;
+            break;
+        default:
+            return false;
+        }
+    }
+    return optind == argc;
+}
+
+/* Samples of every letter rendered by f at each epoch */
+enum { FONT_SAMPLES_PER_LETTER = DATASET_PER_INPUT };
+
+/* Maps the packs into config, the comparison one only if it exists */
+static void load_packs(struct dataset *letters, struct dataset *comparison,
+                       struct train_config *config)
+{
+    if (!dataset_load_alloc(LETTERS_PACK, letters))
+    {
+        errx(1, "Could not load %s, pack it first with p assets/letters %s",
+             LETTERS_PACK, LETTERS_PACK);
+    }
+    bool has_comparison = dataset_load_alloc(COMPARISON_PACK, comparison);
+    printf("%zu letters, %zu comparison samples\n", letters->count,
+           comparison->count);
+
+    config->letters = letters;
+    config->comparison = has_comparison ? comparison : NULL;
+}
+
+static int train(struct neural_network *nn, int argc, char *argv[])
+{
+    struct train_config config = {.loaders = 1};
+    if (!parse_train_options(argc, argv, &config))
+    {
+        print_usage();
+        return 1;
+    }
+
+    struct dataset letters = {0};
+    struct dataset comparison = {0};
+    load_packs(&letters, &comparison, &config);
+    neural_train(nn, &config);
+    neural_save_weights(nn, "weights.bin");
+
+    free_dataset(&letters);
+    free_dataset(&comparison);
+    return 0;
+}
+
+/* Same as train, on letters rendered from the font argv[1] instead of the
+ * letters pack. The comparison pack is still used if there is one */
+static int train_font(struct neural_network *nn, int argc, char *argv[])
+{
+    struct train_config config = {.loaders = 1};
+    if (argc < 2 || !parse_train_options(argc - 1, argv + 1, &config))
+    {
+        print_usage();
+        return 1;
+    }
+
+    struct glyph_set *glyphs = calloc(1, sizeof(*glyphs));
+    if (!glyphs || !glyph_set_load(argv[1], glyphs))
+    {
+        errx(1, "Could not render the letters of %s", argv[1]);
+    }
+    struct glyph_source source = {0};
+    if (!glyph_source_alloc(glyphs, FONT_SAMPLES_PER_LETTER, &source))
+    {
+        errx(1, "Could not allocate the rendered letters");
+    }
+    struct dataset comparison = {0};
+    bool has_comparison = dataset_load_alloc(COMPARISON_PACK, &comparison);
+    printf("%zu letters rendered per epoch, %zu comparison samples\n",
+           source.set.count, comparison.count);
+
+    config.letters = &source.set;
+    config.comparison = has_comparison ? &comparison : NULL;
+    config.renew = glyph_source_renew;
+    config.renew_ctx = &source;
+    neural_train(nn, &config);
+    neural_save_weights(nn, "weights.bin");
+
+    free_dataset(&comparison);
+    free_glyph_source(&source);
+    free(glyphs);
+    return 0;
+}
+
+/* Trains from scratch online, then in mini-batches, then Hogwild, with the
+ * same options otherwise. Every epoch prints its accuracy and throughput.
+ * Nothing is saved */
+static int compare(struct neural_network *nn, int argc, char *argv[])
+{
+    struct train_config config = {
+        .batch_size = 64, .epochs = 3, .loaders = 1};
+    if (!parse_train_options(argc, argv, &config))
+    {
+        print_usage();
+        return 1;
+    }
+
+    // Every mode starts from the same weights and draws
+    if (config.seed == 0)
+    {
+        config.seed = (uint64_t)time(NULL);
+    }
+    struct dataset letters = {0};
+    struct dataset comparison = {0};
+    load_packs(&letters, &comparison, &config);
+
+    struct train_config online = config;
+    online.batch_size = 1;
+    online.hogwild = false;
+    printf("\n== Online, single thread ==\n");
+    neural_train(nn, &online);
+
+    struct train_config batches = config;
+    batches.batch_size = (config.batch_size > 1) ? config.batch_size : 64;
+    batches.hogwild = false;
+    printf("\n\n== Mini-batches of %zu ==\n", batches.batch_size);
+    neural_train(nn, &batches);
+
+    struct train_config hogwild = config;
+    hogwild.hogwild = true;
+    printf("\n\n== Hogwild ==\n");
+    neural_train(nn, &hogwild);
+    printf("\n");
+
+    free_dataset(&letters);
+    free_dataset(&comparison);
+    return 0;
 }
 
 static bool is_valid_arg(const char str[static 2])
 {
-    return (str[0] == 't' || str[0] == 'l' || str[0] == 's') && str[1] == '\0';
+    return (str[0] == 't' || str[0] == 'l' || str[0] == 's' ||
+            str[0] == 'p' || str[0] == 'c' || str[0] == 'f') &&
+           str[1] == '\0';
 }
 
 int main(int argc, char *argv[])
@@ -40,9 +253,25 @@ int main(int argc, char *argv[])
     struct neural_network nn = {0};
     if (argv[1][0] == 't')
     {
-        neural_train(&nn);
-        neural_save_weights(&nn, "weights.bin");
-        return 0;
+        return train(&nn, argc - 1, argv + 1);
+    }
+    if (argv[1][0] == 'c')
+    {
+        return compare(&nn, argc - 1, argv + 1);
+    }
+    if (argv[1][0] == 'f')
+    {
+        return train_font(&nn, argc - 1, argv + 1);
+    }
+    if (argv[1][0] == 'p')
+    {
+        if (argc != 4)
+        {
+            printf("Error: Wrong argument count\n");
+            print_usage();
+            return 1;
+        }
+        return dataset_pack(argv[2], argv[3]) ? 0 : 1;
     }
 
     if (argc != 3)
@@ -67,9 +296,15 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    neural_load_weights(&nn, "weights.bin");
+    struct neural_model model = {0};
+    if (!neural_model_load_alloc("weights.bin", &model))
+    {
+        errx(1, "Could not load weights.bin");
+    }
 
     // char path[128] = {0};
-    char res = neural_find_logic(&nn, argv[2]);
-    printf("Result:%c (%f)\n\n", res, nn.output[res - 'a']);
+    struct neural_workspace ws = {0};
+    char res = neural_find_logic(&model, &ws, argv[2]);
+    printf("Result:%c (%f)\n\n", res, ws.output[res - 'a']);
+    free_neural_model(&model);
 }